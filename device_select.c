@@ -0,0 +1,41 @@
+/* Public header */
+#include "device_select.h"
+
+/* Standard / system libraries */
+#include <string.h>
+
+/* Private functions */
+static bool is_streaming_device(const struct iio_device *dev, bool tx);
+
+/* Public functions */
+struct iio_device *DEVICE_SELECT_Find(const struct iio_context *ctx, const char *name, bool tx)
+{
+	/* Find by name (or id) */
+	if (0 != strcmp(name, DEVICE_SELECT_AUTO))
+		return iio_context_find_device(ctx, name);
+
+	/* Otherwise take first device able to stream in the required direction */
+	unsigned int nb_devices = iio_context_get_devices_count(ctx);
+	for (unsigned int i = 0; i < nb_devices; i++)
+	{
+		struct iio_device *dev = iio_context_get_device(ctx, i);
+		if (is_streaming_device(dev, tx))
+			return dev;
+	}
+
+	return NULL;
+}
+
+/* Private functions */
+static bool is_streaming_device(const struct iio_device *dev, bool tx)
+{
+	unsigned int nb_channels = iio_device_get_channels_count(dev);
+	for (unsigned int i = 0; i < nb_channels; i++)
+	{
+		struct iio_channel *channel = iio_device_get_channel(dev, i);
+		if (iio_channel_is_scan_element(channel) && (tx == iio_channel_is_output(channel)))
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,22 @@
+#ifndef __DEVICE_SELECT_H__
+#define __DEVICE_SELECT_H__
+
+/* Standard libraries */
+#include <stdbool.h>
+
+/* libIIO */
+#include <iio.h>
+
+/* Definitions */
+#define DEVICE_SELECT_AUTO "auto"
+#define DEVICE_SELECT_DEFAULT_RX "cf-ad9361-lpc"
+#define DEVICE_SELECT_DEFAULT_TX "cf-ad9361-dds-core-lpc"
+#define DEVICE_SELECT_PHY "ad9361-phy"
+
+/*
+** Find streaming device by name or id, or if name is DEVICE_SELECT_AUTO the first device with scan elements in the
+** required direction (output for TX). Returns NULL if no such device exists.
+*/
+struct iio_device *DEVICE_SELECT_Find(const struct iio_context *ctx, const char *name, bool tx);
+
+#endif
@@ -17,40 +17,94 @@
 #include <iio.h>
 
 /* Local modules */
+#include "device_select.h"
 #include "epoll_loop.h"
+#include "metrics.h"
+#include "notify.h"
+#include "probes.h"
+#include "stream_config.h"
+#include "trace.h"
 #include "thread_read.h"
 #include "thread_write.h"
 #include "usb_descriptors.h"
 #include "sdr_usb_gadget_types.h"
 
+/* Definitions */
+#define DEFAULT_TRACE_FILE "/tmp/sdr_usb_gadget_trace.bin"
+#define MAX_CONTROL_OUT_SIZE (512)
+
 /* Macros */
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define DEBUG_PRINT(...) if (debug) printf("Main: "__VA_ARGS__)
 
-/* Type definitions */
+/* Type definitions - stream control state */
+typedef enum
+{
+	STREAM_STOPPED,
+	STREAM_RUNNING,
+	STREAM_STOPPING,
+
+} stream_state_t;
+
+/* Type definitions - stream (thread) control */
 typedef struct
 {
-	/* Endpoint file descriptors */
-	int ep[3];
+	/* Eventfd to signal thread to quit */
+	int quit_event_fd;
+
+	/* Eventfd signalled by thread as it exits */
+	int done_event_fd;
 
-	/* Eventfds to signal threads */
-	int read_thread_event_fd;
-	int write_thread_event_fd;
+	/* Control state */
+	stream_state_t state;
 
-	/* Thread status */
-	bool read_started;
-	bool write_started;
+	/* Start request received while running / stopping, applied once stopped */
+	bool start_pending;
+	STREAM_CONFIG_Params_t pending_config;
+
+	/* Thread */
+	pthread_t thread;
+
+} stream_t;
+
+/* Type definitions - interface, streaming over a bulk endpoint pair */
+typedef struct
+{
+	/* Streams (RX, TX) */
+	stream_t streams[2];
 
 	/* Thread arguments */
 	THREAD_READ_Args_t read_args;
 	THREAD_WRITE_Args_t write_args;
 
+	/* Buffer lifecycle traces (RX, TX) */
+	TRACE_Ring_t trace_rings[2];
+
+} interface_t;
+
+/* Type definitions */
+typedef struct
+{
+	/* Endpoint file descriptors (indexed by endpoint number) */
+	int ep[USB_DESCRIPTORS_MAX_ENDPOINTS];
+
+	/* Descriptor configuration */
+	USB_DESCRIPTORS_Config_t descriptors;
+
+	/* Interfaces */
+	interface_t interfaces[SDR_USB_GADGET_MAX_INTERFACES];
+
 	/* Configuration enabled */
 	bool config_enabled;
 
-	/* Threads */
-	pthread_t thread_read;
-	pthread_t thread_write;
+	/* Speed negotiated when configuration enabled (enum usb_device_speed) */
+	uint32_t usb_speed;
+
+	/* Runtime counters */
+	METRICS_Shared_t *metrics;
+
+	/* Host event notifications */
+	NOTIFY_Ctx_t notify;
 
 } state_t;
 
@@ -59,27 +113,44 @@ typedef int (*epoll_event_handler)(state_t *state);
 
 /* Global variables */
 bool debug;
+bool cumulative_stats;
 
 /* Private function */
 static int handle_ep0(state_t *state);
-static bool start_thread(state_t *state, bool tx);
-static bool stop_thread(state_t *state, bool tx);
+static int handle_notify_wake(state_t *state);
+static int handle_notify_aio(state_t *state);
+static int handle_thread_done(state_t *state);
+static bool request_start(state_t *state, unsigned int interface, bool tx, const STREAM_CONFIG_Params_t *config);
+static bool request_stop(state_t *state, unsigned int interface, bool tx);
+static bool start_thread(state_t *state, unsigned int interface, bool tx);
+static void join_thread(state_t *state, unsigned int interface, bool tx);
+static bool is_isochronous(const state_t *state, unsigned int interface);
+static bool check_loopback(const state_t *state, unsigned int interface, bool tx, const STREAM_CONFIG_Params_t *config);
 static bool open_endpoints(state_t *state, const char* path);
+static bool open_endpoint(state_t *state, char *ep_path, const char *path, unsigned int number, int flags);
 static void close_endpoints(state_t *state);
 static void signal_handler(int signum);
+static void dump_trace_handler(int signum);
+static bool parse_device_option(char *option, const char *devices[SDR_USB_GADGET_MAX_INTERFACES]);
+static void warn_shared_devices(const char *devices[SDR_USB_GADGET_MAX_INTERFACES], unsigned int count, const char *name);
 static void print_usage(const char *program_name, FILE *dest);
 static const char* event_to_string(struct usb_functionfs_event *event);
 
 /* Private variables */
 static volatile sig_atomic_t keep_running = 1;
+static volatile sig_atomic_t dump_trace = 0;
 
 /* Public functions */
 int main(int argc, char *argv[])
 {
 	state_t state;
 
-	/* Reset state */
+	/* Reset state, marking endpoints unopened */
 	memset(&state, 0x00, sizeof(state));
+	for (unsigned int i = 0; i < ARRAY_SIZE(state.ep); i++)
+	{
+		state.ep[i] = -1;
+	}
 
 	/* Ensure stdout is line buffered */
 	setlinebuf(stdout);
@@ -91,15 +162,37 @@ int main(int argc, char *argv[])
 	/* Long options array, mapping options to their short equivalents */
 	struct option long_options[] = {
 		{"debug", no_argument, NULL, 'd'},
+		{"cumulative-stats", no_argument, NULL, 'c'},
+		{"trace", required_argument, NULL, 't'},
+		{"trace-file", required_argument, NULL, 'T'},
+		{"superspeed", no_argument, NULL, 's'},
+		{"max-burst", required_argument, NULL, 'b'},
+		{"max-streams", required_argument, NULL, 'S'},
+		{"interfaces", required_argument, NULL, 'n'},
+		{"isochronous", required_argument, NULL, 'i'},
+		{"rx-device", required_argument, NULL, 'r'},
+		{"tx-device", required_argument, NULL, 'x'},
 		{"version", no_argument, NULL, 'v'},
 		{"help", no_argument, NULL, 'h'},
 		{0, 0, 0, 0} // Terminate the options array
 	};
 
+	/* Default to a single interface */
+	state.descriptors.num_interfaces = 1;
+
 	/* Basic argument parsing */
 	int opt_c;
 	bool err = false;
-	while ((opt_c = getopt_long(argc, argv, "dhv", long_options, NULL)) != -1)
+	uint32_t trace_records = 0;
+	const char *trace_file = DEFAULT_TRACE_FILE;
+	const char *rx_devices[SDR_USB_GADGET_MAX_INTERFACES];
+	const char *tx_devices[SDR_USB_GADGET_MAX_INTERFACES];
+	for (unsigned int i = 0; i < SDR_USB_GADGET_MAX_INTERFACES; i++)
+	{
+		rx_devices[i] = DEVICE_SELECT_DEFAULT_RX;
+		tx_devices[i] = DEVICE_SELECT_DEFAULT_TX;
+	}
+	while ((opt_c = getopt_long(argc, argv, "dct:T:sb:S:n:i:r:x:hv", long_options, NULL)) != -1)
 	{
 			switch (opt_c)
 			{
@@ -108,6 +201,80 @@ int main(int argc, char *argv[])
 					debug = true;
 					break;
 				}
+				case 'c':
+				{
+					cumulative_stats = true;
+					break;
+				}
+				case 't':
+				{
+					trace_records = (uint32_t)strtoul(optarg, NULL, 0);
+					break;
+				}
+				case 'T':
+				{
+					trace_file = optarg;
+					break;
+				}
+				case 's':
+				{
+					state.descriptors.superspeed = true;
+					break;
+				}
+				case 'b':
+				{
+					unsigned long value = strtoul(optarg, NULL, 0);
+					if (value > 15)
+					{
+						fprintf(stderr, "Error: Max burst must be 0 - 15\n");
+						err = true;
+					}
+					state.descriptors.max_burst = (uint8_t)value;
+					break;
+				}
+				case 'S':
+				{
+					unsigned long value = strtoul(optarg, NULL, 0);
+					if (value > 16)
+					{
+						fprintf(stderr, "Error: Max streams must be 0 - 16\n");
+						err = true;
+					}
+					state.descriptors.max_streams = (uint8_t)value;
+					break;
+				}
+				case 'n':
+				{
+					unsigned long value = strtoul(optarg, NULL, 0);
+					if ((value < 1) || (value > SDR_USB_GADGET_MAX_INTERFACES))
+					{
+						fprintf(stderr, "Error: Interfaces must be 1 - %u\n", SDR_USB_GADGET_MAX_INTERFACES);
+						err = true;
+					}
+					state.descriptors.num_interfaces = (uint8_t)value;
+					break;
+				}
+				case 'i':
+				{
+					unsigned long value = strtoul(optarg, NULL, 0);
+					if ((value < 1) || (value > 3))
+					{
+						fprintf(stderr, "Error: Isochronous packets per microframe must be 1 - 3\n");
+						err = true;
+					}
+					state.descriptors.iso_mult = (uint8_t)value;
+					break;
+				}
+				case 'r':
+				{
+					err |= !parse_device_option(optarg, rx_devices);
+					break;
+				}
+				case 'x':
+				{
+					err |= !parse_device_option(optarg, tx_devices);
+					break;
+				}
 				case 'v':
 				{
 					printf("Version %s\n", PROGRAM_VERSION);
@@ -143,44 +310,92 @@ int main(int argc, char *argv[])
 	/* Retrieve FFS directory */
 	char *ffs_directory = argv[optind];
 
+	/* Warn of interfaces which would contend for a device */
+	warn_shared_devices(rx_devices, state.descriptors.num_interfaces, "rx");
+	warn_shared_devices(tx_devices, state.descriptors.num_interfaces, "tx");
+
+	/* Burst / streams only described by SuperSpeed descriptors */
+	if (!state.descriptors.superspeed && ((state.descriptors.max_burst > 0) || (state.descriptors.max_streams > 0)))
+	{
+		fprintf(stderr, "Warning: Max burst / streams ignored without --superspeed\n");
+	}
+
 	/* Register signal handler */
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+	signal(SIGUSR1, dump_trace_handler);
 
 	/* Open endpoints */
 	if (!open_endpoints(&state, ffs_directory))
 		return 1;
 
-	/* Prepare eventfds to notify threads to cancel */
-	state.read_thread_event_fd = eventfd(0, 0);
-	if (state.read_thread_event_fd < 0)
-	{
-		perror("Failed to open read eventfd");
-		return 1;
-	}
-	else
+	/* Prepare eventfds to notify threads to cancel, and threads to notify us of their exit */
+	unsigned int num_interfaces = state.descriptors.num_interfaces;
+	for (unsigned int i = 0; i < num_interfaces; i++)
 	{
-		DEBUG_PRINT("Opened read eventfd :-)\n");
+		for (unsigned int j = 0; j < ARRAY_SIZE(state.interfaces[i].streams); j++)
+		{
+			stream_t *stream = &state.interfaces[i].streams[j];
+			stream->quit_event_fd = eventfd(0, EFD_NONBLOCK);
+			stream->done_event_fd = eventfd(0, EFD_NONBLOCK);
+			if ((stream->quit_event_fd < 0) || (stream->done_event_fd < 0))
+			{
+				perror("Failed to open thread eventfd");
+				return 1;
+			}
+		}
 	}
-	state.write_thread_event_fd = eventfd(0, 0);
-	if (state.write_thread_event_fd < 0)
-	{
-		perror("Failed to open write eventfd");
+	DEBUG_PRINT("Opened thread eventfds :-)\n");
+
+	/* Publish runtime counters */
+	state.metrics = METRICS_Init(num_interfaces);
+	if (!state.metrics)
 		return 1;
+
+	/* Prepare event notifications */
+	if (!NOTIFY_Init(&state.notify, state.ep[USB_DESCRIPTORS_EVENT_ENDPOINT]))
+		return 1;
+
+	for (unsigned int i = 0; i < num_interfaces; i++)
+	{
+		interface_t *interface = &state.interfaces[i];
+
+		/* Prepare read args */
+		interface->read_args.quit_event_fd = interface->streams[0].quit_event_fd;
+		interface->read_args.done_event_fd = interface->streams[0].done_event_fd;
+		interface->read_args.output_fd = state.ep[USB_DESCRIPTORS_GetBulkEndpoint(i, false)];
+		interface->read_args.metrics = &state.metrics->interfaces[i].rx;
+		interface->read_args.trace = (trace_records > 0) ? &interface->trace_rings[0] : NULL;
+		interface->read_args.notify = NOTIFY_GetSource(&state.notify, i, false);
+		interface->read_args.default_device = rx_devices[i];
+		interface->read_args.peer_metrics = &state.metrics->interfaces[i].tx;
+
+		/* Prepare write args */
+		interface->write_args.quit_event_fd = interface->streams[1].quit_event_fd;
+		interface->write_args.done_event_fd = interface->streams[1].done_event_fd;
+		interface->write_args.input_fd = state.ep[USB_DESCRIPTORS_GetBulkEndpoint(i, true)];
+		interface->write_args.metrics = &state.metrics->interfaces[i].tx;
+		interface->write_args.trace = (trace_records > 0) ? &interface->trace_rings[1] : NULL;
+		interface->write_args.notify = NOTIFY_GetSource(&state.notify, i, true);
+		interface->write_args.default_device = tx_devices[i];
+		interface->write_args.loopback_fd = interface->read_args.output_fd;
+		interface->write_args.loopback_metrics = interface->read_args.metrics;
+
+		/* Allocate traces */
+		if (trace_records > 0)
+		{
+			for (unsigned int j = 0; j < ARRAY_SIZE(interface->trace_rings); j++)
+			{
+				if (!TRACE_Init(&interface->trace_rings[j], trace_records, (uint8_t)i))
+					return 1;
+			}
+		}
 	}
-	else
+	if (trace_records > 0)
 	{
-		DEBUG_PRINT("Opened write eventfd :-)\n");
+		DEBUG_PRINT("Allocated traces, send SIGUSR1 to dump to %s :-)\n", trace_file);
 	}
 
-	/* Prepare read args */
-	state.read_args.quit_event_fd = state.read_thread_event_fd;
-	state.read_args.output_fd = state.ep[1];
-
-	/* Prepare write args */
-	state.write_args.quit_event_fd = state.write_thread_event_fd;
-	state.write_args.input_fd = state.ep[2];
-
 	/* Create epoll instance */
 	int epoll_fd = epoll_create1(0);
 	if (epoll_fd < 0)
@@ -209,6 +424,42 @@ int main(int argc, char *argv[])
 		DEBUG_PRINT("Registered ep0 with epoll :-)\n");
 	}
 
+	/* Register event notification eventfds with epoll */
+	epoll_event.events = EPOLLIN;
+	epoll_event.data.ptr = handle_notify_wake;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state.notify.wake_fd, &epoll_event) < 0)
+	{
+		perror("Failed to register notify eventfd with epoll");
+		return 1;
+	}
+	epoll_event.events = EPOLLIN;
+	epoll_event.data.ptr = handle_notify_aio;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state.notify.aio_eventfd, &epoll_event) < 0)
+	{
+		perror("Failed to register notify aio eventfd with epoll");
+		return 1;
+	}
+	else
+	{
+		DEBUG_PRINT("Registered notify eventfds with epoll :-)\n");
+	}
+
+	/* Register thread exit eventfds with epoll */
+	for (unsigned int i = 0; i < num_interfaces; i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(state.interfaces[i].streams); j++)
+		{
+			epoll_event.events = EPOLLIN;
+			epoll_event.data.ptr = handle_thread_done;
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state.interfaces[i].streams[j].done_event_fd, &epoll_event) < 0)
+			{
+				perror("Failed to register thread eventfd with epoll");
+				return 1;
+			}
+		}
+	}
+	DEBUG_PRINT("Registered thread eventfds with epoll :-)\n");
+
 	/* Here we go */
 	printf("Ready :-)\n");
 
@@ -222,18 +473,53 @@ int main(int argc, char *argv[])
 			/* Handler failed...bail */
 			break;
 		}
+
+		/* Dump trace if requested */
+		if (dump_trace)
+		{
+			dump_trace = 0;
+			TRACE_Ring_t *rings[SDR_USB_GADGET_MAX_INTERFACES * 2];
+			for (unsigned int i = 0; i < num_interfaces; i++)
+			{
+				rings[(2 * i) + 0] = state.interfaces[i].read_args.trace;
+				rings[(2 * i) + 1] = state.interfaces[i].write_args.trace;
+			}
+			TRACE_Dump(trace_file, rings, 2 * num_interfaces);
+		}
 	}
 	DEBUG_PRINT("Exit main loop :-(\n");
 
-	/* Stop threads */
-	stop_thread(&state, false);
-	stop_thread(&state, true);
+	/* Stop threads, waiting for them to exit */
+	for (unsigned int i = 0; i < num_interfaces; i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(state.interfaces[i].streams); j++)
+		{
+			state.interfaces[i].streams[j].start_pending = false;
+			request_stop(&state, i, (1 == j));
+			join_thread(&state, i, (1 == j));
+		}
+	}
 
 	/* Close files */
 	close(epoll_fd);
-	close(state.read_thread_event_fd);
-	close(state.write_thread_event_fd);
+	for (unsigned int i = 0; i < num_interfaces; i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(state.interfaces[i].streams); j++)
+		{
+			close(state.interfaces[i].streams[j].quit_event_fd);
+			close(state.interfaces[i].streams[j].done_event_fd);
+		}
+	}
+	NOTIFY_Deinit(&state.notify);
 	close_endpoints(&state);
+	METRICS_Deinit(state.metrics);
+	for (unsigned int i = 0; i < num_interfaces; i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(state.interfaces[i].trace_rings); j++)
+		{
+			TRACE_Deinit(&state.interfaces[i].trace_rings[j]);
+		}
+	}
 
 	/* Goodbye */
 	printf("Bye!\n");
@@ -272,8 +558,80 @@ static int handle_ep0(state_t *state)
 
 			if (event.u.setup.bRequestType & USB_DIR_IN)
 			{
-				/* Write null response */
-				if (write(state->ep[0], NULL, 0) < 0)
+				union
+				{
+					cmd_usb_status_response_t status;
+					cmd_usb_stats_response_t stats;
+					cmd_usb_capabilities_response_t capabilities;
+				} response;
+				size_t response_size = 0;
+
+				/* Select counters of target thread (of the first interface, should the interface be out of range) */
+				unsigned int interface = (event.u.setup.wIndex < state->descriptors.num_interfaces) ? event.u.setup.wIndex : 0;
+				const METRICS_Interface_t *interface_metrics = &state->metrics->interfaces[interface];
+				const METRICS_Thread_t *metrics = (SDR_USB_GADGET_COMMAND_TARGET_TX == event.u.setup.wValue) ? &interface_metrics->tx : &interface_metrics->rx;
+
+				/* Act on request, reading counters published by threads (without blocking them) */
+				switch (event.u.setup.bRequest)
+				{
+					case SDR_USB_GADGET_COMMAND_GET_STATUS:
+					{
+						response.status.state = atomic_load_explicit(&metrics->state, memory_order_acquire);
+						response.status.enabled_channels = atomic_load_explicit(&metrics->enabled_channels, memory_order_relaxed);
+						response.status.buffer_size = atomic_load_explicit(&metrics->buffer_size, memory_order_relaxed);
+						response.status.usb_buffer_size = atomic_load_explicit(&metrics->usb_buffer_size, memory_order_relaxed);
+						response.status.queue_depth = atomic_load_explicit(&metrics->queue_depth, memory_order_relaxed);
+						response.status.usb_speed = state->usb_speed;
+						response.status.max_packet_size = is_isochronous(state, interface) ? USB_DESCRIPTORS_GetIsoBytesPerInterval(state->usb_speed) : USB_DESCRIPTORS_GetBulkMaxPacketSize(state->usb_speed);
+						response_size = sizeof(response.status);
+						break;
+					}
+					case SDR_USB_GADGET_COMMAND_GET_STATS:
+					{
+						response.stats.bytes = METRICS_Read(&metrics->bytes);
+						response.stats.buffers = METRICS_Read(&metrics->buffers);
+						response.stats.overflows = METRICS_Read(&metrics->overflows);
+						response.stats.underruns = METRICS_Read(&metrics->underruns);
+						response.stats.errors = METRICS_Read(&metrics->aio_errors);
+						response.stats.late = METRICS_Read(&metrics->late);
+						response.stats.lost = METRICS_Read(&metrics->lost);
+						response.stats.gaps = METRICS_Read(&metrics->gaps);
+						response.stats.corrupt = METRICS_Read(&metrics->corrupt);
+						response.stats.loopback_offset = 0;
+						response.stats.loopback_latency = 0;
+						uint64_t rx_marker_time = METRICS_GetMarkerTime(&interface_metrics->rx);
+						uint64_t tx_marker_time = METRICS_GetMarkerTime(&interface_metrics->tx);
+						if ((metrics == &interface_metrics->rx) && (rx_marker_time > 0) && (tx_marker_time > 0) && (tx_marker_time <= rx_marker_time))
+						{
+							/* Digital loopback marker received, relate it to its transmission */
+							response.stats.loopback_offset = (int64_t)(METRICS_Read(&interface_metrics->rx.marker_sample) - METRICS_Read(&interface_metrics->tx.marker_sample));
+							response.stats.loopback_latency = rx_marker_time - tx_marker_time;
+						}
+						response_size = sizeof(response.stats);
+						break;
+					}
+					case SDR_USB_GADGET_COMMAND_GET_CAPABILITIES:
+					{
+						STREAM_CONFIG_GetCapabilities(&response.capabilities);
+						response.capabilities.num_interfaces = state->descriptors.num_interfaces;
+						response_size = sizeof(response.capabilities);
+						break;
+					}
+					default:
+					{
+						/* Unknown request, null response */
+						break;
+					}
+				}
+
+				/* Truncate response to that requested */
+				if (response_size > event.u.setup.wLength)
+				{
+					response_size = event.u.setup.wLength;
+				}
+
+				/* Write response */
+				if (write(state->ep[0], &response, response_size) < 0)
 				{
 					perror("Failed to write packet to host");
 					return -1;
@@ -281,8 +639,8 @@ static int handle_ep0(state_t *state)
 			}
 			else
 			{
-				uint8_t control_in_data[64];
-				const cmd_usb_start_request_t *cmd_start_req = (const cmd_usb_start_request_t*)control_in_data;
+				uint8_t control_in_data[MAX_CONTROL_OUT_SIZE];
+				STREAM_CONFIG_Params_t config;
 
 				/* Read request */
 				ssize_t read_count = read(state->ep[0], control_in_data, sizeof(control_in_data));
@@ -292,40 +650,50 @@ static int handle_ep0(state_t *state)
 					return -1;
 				}
 
+				/* Ignore requests for interfaces not provided */
+				unsigned int interface = event.u.setup.wIndex;
+				if (interface >= state->descriptors.num_interfaces)
+				{
+					printf("Ignoring request for interface %u\n", interface);
+					break;
+				}
+
 				/* Act on request */
 				switch (event.u.setup.bRequest)
 				{
 					case SDR_USB_GADGET_COMMAND_START:
+					case SDR_USB_GADGET_COMMAND_START_TLV:
 					{
-						/* Check request size */
-						if (read_count != sizeof(*cmd_start_req))
+						/* Queue deeper by default at SuperSpeed, to cover the greater bandwidth delay product, shallower if isochronous to bound latency */
+						uint32_t default_queue_depth = (state->descriptors.superspeed && (state->usb_speed >= USB_SPEED_SUPER)) ? STREAM_CONFIG_DEFAULT_QUEUE_DEPTH_SS : STREAM_CONFIG_DEFAULT_QUEUE_DEPTH;
+						if (is_isochronous(state, interface))
 						{
-							printf("Bad start request, incorrect data size\n");
-							break;
+							default_queue_depth = STREAM_CONFIG_DEFAULT_QUEUE_DEPTH_ISO;
 						}
 
-						/* Decide on TX vs RX thread */
-						bool tx = (SDR_USB_GADGET_COMMAND_TARGET_TX == event.u.setup.wValue);
-
-						/* Ensure thread stopped */
-						stop_thread(state, tx);
-
-						/* Act on direction */
-						if (tx)
+						/* Parse request (fixed legacy layout, or tag-length-value list) */
+						bool ok;
+						if (SDR_USB_GADGET_COMMAND_START == event.u.setup.bRequest)
 						{
-							/* TX thread, store args */
-							state->write_args.iio_channels = cmd_start_req->enabled_channels;
-							state->write_args.iio_buffer_size = cmd_start_req->buffer_size;
+							ok = STREAM_CONFIG_ParseStart(control_in_data, read_count, default_queue_depth, &config);
 						}
 						else
 						{
-							/* RX thread, store args */
-							state->read_args.iio_channels = cmd_start_req->enabled_channels;
-							state->read_args.iio_buffer_size = cmd_start_req->buffer_size;
+							ok = STREAM_CONFIG_ParseTLV(control_in_data, read_count, default_queue_depth, &config);
 						}
+						if (!ok)
+							break;
+
+						/* Decide on TX vs RX thread */
+						bool tx = (SDR_USB_GADGET_COMMAND_TARGET_TX == event.u.setup.wValue);
+						if (!STREAM_CONFIG_CheckTarget(&config, tx))
+							break;
+						if (!check_loopback(state, interface, tx, &config))
+							break;
 
-						/* Start thread */
-						start_thread(state, tx);
+						/* Start thread, once any running thread has stopped */
+						if (!request_start(state, interface, tx, &config))
+							return -1;
 						break;
 					}
 					case SDR_USB_GADGET_COMMAND_STOP:
@@ -333,8 +701,10 @@ static int handle_ep0(state_t *state)
 						/* Decide on TX vs RX thread */
 						bool tx = (0 != event.u.setup.wValue);
 
-						/* Stop thread */
-						stop_thread(state, tx);
+						/* Stop thread, cancelling any pending start */
+						state->interfaces[interface].streams[tx].start_pending = false;
+						if (!request_stop(state, interface, tx))
+							return -1;
 						break;
 					}
 					default:
@@ -350,25 +720,34 @@ static int handle_ep0(state_t *state)
 		{
 			if (state->config_enabled)
 			{
-				/* Stop threads */
-				if (!(	  stop_thread(state, false)
-					   && stop_thread(state, true)
-					 )
-				   )
+				/* Stop threads, their exit completing asynchronously */
+				for (unsigned int i = 0; i < state->descriptors.num_interfaces; i++)
 				{
-					/* Failed to stop a thread */
-					return -1;
+					for (unsigned int j = 0; j < ARRAY_SIZE(state->interfaces[i].streams); j++)
+					{
+						state->interfaces[i].streams[j].start_pending = false;
+						if (!request_stop(state, i, (1 == j)))
+						{
+							/* Failed to stop a thread */
+							return -1;
+						}
+					}
 				}
 			}
 
 			/* Flag disabled */
 			state->config_enabled = false;
+			state->usb_speed = USB_SPEED_UNKNOWN;
 			break;
 		}
 		case FUNCTIONFS_ENABLE:
 		{
 			/* Flag enabled */
 			state->config_enabled = true;
+
+			/* Retrieve negotiated speed, sizing subsequent streams */
+			state->usb_speed = USB_DESCRIPTORS_GetSpeed();
+			DEBUG_PRINT("Bus speed: %u, bulk max packet size: %u\n", state->usb_speed, USB_DESCRIPTORS_GetBulkMaxPacketSize(state->usb_speed));
 			break;
 		}
 		default:
@@ -381,8 +760,129 @@ static int handle_ep0(state_t *state)
 	return 0;
 }
 
-static bool start_thread(state_t *state, bool tx)
+static int handle_notify_wake(state_t *state)
+{
+	/* Collect events posted by threads */
+	return NOTIFY_HandleWake(&state->notify);
+}
+
+static int handle_notify_aio(state_t *state)
 {
+	/* Send next event to host */
+	return NOTIFY_HandleComplete(&state->notify);
+}
+
+static int handle_thread_done(state_t *state)
+{
+	/* Check each thread's eventfd (all sharing this handler), handling those which have exited */
+	for (unsigned int i = 0; i < state->descriptors.num_interfaces; i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(state->interfaces[i].streams); j++)
+		{
+			stream_t *stream = &state->interfaces[i].streams[j];
+			bool tx = (1 == j);
+
+			/* Read eventfd to reset it, skipping threads which haven't exited */
+			uint64_t eventfd_val;
+			if (read(stream->done_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
+			{
+				if (EAGAIN == errno)
+					continue;
+
+				perror("Failed to read thread done eventfd");
+				return -1;
+			}
+
+			/* Join with thread, which has exited (or is about to) either on request or due to an error */
+			join_thread(state, i, tx);
+
+			/* Apply start request received while stopping */
+			if (stream->start_pending)
+			{
+				if (!start_thread(state, i, tx))
+					return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static bool request_start(state_t *state, unsigned int interface, bool tx, const STREAM_CONFIG_Params_t *config)
+{
+	stream_t *stream = &state->interfaces[interface].streams[tx];
+
+	/* Store request, applied once thread is stopped */
+	stream->pending_config = *config;
+	stream->start_pending = true;
+
+	/* Start immediately if stopped, otherwise once the running thread has exited */
+	if (STREAM_STOPPED == stream->state)
+	{
+		return start_thread(state, interface, tx);
+	}
+
+	return request_stop(state, interface, tx);
+}
+
+static bool request_stop(state_t *state, unsigned int interface, bool tx)
+{
+	stream_t *stream = &state->interfaces[interface].streams[tx];
+
+	if (STREAM_RUNNING == stream->state)
+	{
+		/* Write eventfd to signal thread to stop, completion signalled via done eventfd */
+		uint64_t eventfd_val = 0x1;
+		if (write(stream->quit_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
+		{
+			perror("Failed to write to thread quit eventfd");
+			return false;
+		}
+
+		/* Flag stopping */
+		stream->state = STREAM_STOPPING;
+		DEBUG_PRINT("Stopping %s thread %u\n", tx ? "write" : "read", interface);
+	}
+
+	return true;
+}
+
+static bool start_thread(state_t *state, unsigned int interface, bool tx)
+{
+	interface_t *iface = &state->interfaces[interface];
+	stream_t *stream = &iface->streams[tx];
+
+	/* Thread must be stopped, such that its arguments aren't in use */
+	if (STREAM_STOPPED != stream->state)
+		return true;
+
+	/* Apply start request to thread arguments */
+	const STREAM_CONFIG_Params_t *config = &stream->pending_config;
+	stream->start_pending = false;
+	bool isochronous = is_isochronous(state, interface);
+	uint32_t max_packet_size = isochronous ? USB_DESCRIPTORS_GetIsoBytesPerInterval(state->usb_speed) : USB_DESCRIPTORS_GetBulkMaxPacketSize(state->usb_speed);
+	if (tx)
+	{
+		iface->write_args.config = *config;
+		iface->write_args.max_packet_size = max_packet_size;
+		iface->write_args.isochronous = isochronous;
+		iface->write_args.interval_us = USB_DESCRIPTORS_GetIsoIntervalMicros(state->usb_speed);
+		iface->write_args.mark_loopback = (STREAM_STOPPED != iface->streams[0].state) && iface->read_args.config.digital_loopback;
+	}
+	else
+	{
+		iface->read_args.config = *config;
+		iface->read_args.max_packet_size = max_packet_size;
+		iface->read_args.isochronous = isochronous;
+		iface->read_args.interval_us = USB_DESCRIPTORS_GetIsoIntervalMicros(state->usb_speed);
+
+		/* Clear any marker left by an earlier TX stream (stopped, see check_loopback()), such that RX waits for the next */
+		if (config->digital_loopback)
+		{
+			METRICS_SetMarker(&state->metrics->interfaces[interface].tx, 0, 0);
+		}
+	}
+
 	/* Mask all signals (such that threads will by default not handle them) */
 	sigset_t new_mask, old_mask;
 	sigfillset(&new_mask);
@@ -393,25 +893,24 @@ static bool start_thread(state_t *state, bool tx)
 	}
 
 	/* Create appropriate thread */
-	if (tx && !state->write_started)
+	PROBE3(stream_start, tx, config->enabled_channels, config->buffer_size);
+	int rc;
+	if (tx)
 	{
-		/* Start thread */
-		state->write_started = (0 == pthread_create(&state->thread_write, NULL, &THREAD_WRITE_Entrypoint, &state->write_args));
-		if (!state->write_started)
-		{
-			perror("Failed to start write thread");
-			return false;
-		}
+		rc = pthread_create(&stream->thread, NULL, &THREAD_WRITE_Entrypoint, &iface->write_args);
+	}
+	else
+	{
+		rc = pthread_create(&stream->thread, NULL, &THREAD_READ_Entrypoint, &iface->read_args);
 	}
-	else if (!tx && !state->read_started)
+	if (0 != rc)
 	{
-		/* Start thread */
-		state->read_started = (0 == pthread_create(&state->thread_read, NULL, &THREAD_READ_Entrypoint, &state->read_args));
-		if (!state->read_started)
-		{
-			perror("Failed to start read thread");
-			return false;
-		}
+		errno = rc;
+		perror(tx ? "Failed to start write thread" : "Failed to start read thread");
+	}
+	else
+	{
+		stream->state = STREAM_RUNNING;
 	}
 
 	/* Return signal mask to old value, such that all signals will be handled by main thread */
@@ -421,56 +920,62 @@ static bool start_thread(state_t *state, bool tx)
 		return false;
 	}
 
-	return true;
+	return (0 == rc);
 }
 
-static bool stop_thread(state_t *state, bool tx)
+static void join_thread(state_t *state, unsigned int interface, bool tx)
 {
-	if (tx && state->write_started)
-	{
-		/* Write eventfd to signal thread to stop */
-		uint64_t eventfd_val = 0x1;
-		if (write(state->write_thread_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
-		{
-			perror("Failed to write to write thread eventfd");
-			return false;
-		}
+	stream_t *stream = &state->interfaces[interface].streams[tx];
 
-		/* Join with thread */
-		pthread_join(state->thread_write, NULL);
+	if (STREAM_STOPPED == stream->state)
+		return;
 
-		/* Read eventfd now thread has stopped to reset it */
-		if (read(state->write_thread_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
-		{
-			perror("Failed to read from write thread eventfd");
-			return false;
-		}
+	/* Join with thread */
+	pthread_join(stream->thread, NULL);
 
-		/* Clear running flag */
-		state->write_started = false;
-	}
-	else if (!tx && state->read_started)
+	/* Read quit eventfd now thread has stopped to reset it (it won't have been written if the thread failed) */
+	uint64_t eventfd_val;
+	if ((read(stream->quit_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0) && (EAGAIN != errno))
 	{
-		/* Write eventfd to signal thread to stop */
-		uint64_t eventfd_val = 0x1;
-		if (write(state->read_thread_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
-		{
-			perror("Failed to write to read thread eventfd");
-			return false;
-		}
+		perror("Failed to read from thread quit eventfd");
+	}
 
-		/* Join with thread */
-		pthread_join(state->thread_read, NULL);
+	/* Flag stopped */
+	stream->state = STREAM_STOPPED;
+	PROBE1(stream_stop, tx);
+	DEBUG_PRINT("Joined %s thread %u\n", tx ? "write" : "read", interface);
+}
 
-		/* Read eventfd now thread has stopped to reset it */
-		if (read(state->read_thread_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
-		{
-			perror("Failed to read from read thread eventfd");
-			return false;
-		}
+static bool is_isochronous(const state_t *state, unsigned int interface)
+{
+	/* Only the first interface's data endpoints may be isochronous, falling back to bulk at full speed */
+	return USB_DESCRIPTORS_IsIsochronous(state->usb_speed, interface);
+}
+
+static bool check_loopback(const state_t *state, unsigned int interface, bool tx, const STREAM_CONFIG_Params_t *config)
+{
+	const interface_t *iface = &state->interfaces[interface];
+	const stream_t *rx_stream = &iface->streams[0];
+	const stream_t *tx_stream = &iface->streams[1];
+
+	/* TX loopback writes to the RX endpoint, so the two can't run together */
+	if (tx && (SDR_USB_GADGET_LOOPBACK_NONE != config->loopback) && ((STREAM_STOPPED != rx_stream->state) || rx_stream->start_pending))
+	{
+		printf("Bad start request, loopback requires RX %u to be stopped\n", interface);
+		return false;
+	}
+	if (!tx && (((STREAM_STOPPED != tx_stream->state) && (SDR_USB_GADGET_LOOPBACK_NONE != iface->write_args.config.loopback)) ||
+				(tx_stream->start_pending && (SDR_USB_GADGET_LOOPBACK_NONE != tx_stream->pending_config.loopback))))
+	{
+		printf("Bad start request, RX %u endpoint in use by TX loopback\n", interface);
+		return false;
+	}
 
-		/* Clear running flag */
-		state->read_started = false;
+	/* Digital loopback takes the first non-zero sample pushed after TX starts as its marker, so TX must start after RX */
+	if (!tx && config->digital_loopback && ((STREAM_STOPPED != tx_stream->state) || tx_stream->start_pending))
+	{
+		printf("Bad start request, digital loopback requires TX %u to be stopped (start RX first)\n", interface);
+		return false;
 	}
 
 	return true;
@@ -501,49 +1006,59 @@ static bool open_endpoints(state_t *state, const char* path)
 	}
 
 	/* Provide descriptors and strings to kernel, writing them to ep0 */
-	if (!USB_DESCRIPTORS_WriteToEP0(state->ep[0]))
+	if (!USB_DESCRIPTORS_WriteToEP0(state->ep[0], &state->descriptors))
 		return false;
 
-	/* Open bulk in/out endpoints */
-	sprintf(ep_path, "%s/ep1", path);
-	DEBUG_PRINT("Opening: %s...\n", ep_path);
-	state->ep[1] = open(ep_path, O_WRONLY);
-	if (state->ep[1] < 0)
-	{
-		perror("Failed to open ep1");
-		return false;
-	}
-	else
+	/* Open bulk in/out endpoints of each interface */
+	for (unsigned int i = 0; i < state->descriptors.num_interfaces; i++)
 	{
-		DEBUG_PRINT("Opened ep1 :-)\n");
+		if (   !open_endpoint(state, ep_path, path, USB_DESCRIPTORS_GetBulkEndpoint(i, false), O_WRONLY)
+			|| !open_endpoint(state, ep_path, path, USB_DESCRIPTORS_GetBulkEndpoint(i, true), O_RDONLY)
+		   )
+		{
+			return false;
+		}
 	}
 
-	sprintf(ep_path, "%s/ep2", path);
+	/* Open interrupt in endpoint */
+	if (!open_endpoint(state, ep_path, path, USB_DESCRIPTORS_EVENT_ENDPOINT, O_WRONLY))
+		return false;
+
+	/* Free endpoint path buffer */
+	free(ep_path);
+	ep_path = NULL;
+
+	return true;
+}
+
+static bool open_endpoint(state_t *state, char *ep_path, const char *path, unsigned int number, int flags)
+{
+	sprintf(ep_path, "%s/ep%u", path, number);
 	DEBUG_PRINT("Opening: %s...\n", ep_path);
-	state->ep[2] = open(ep_path, O_RDONLY);
-	if (state->ep[2] < 0)
+	state->ep[number] = open(ep_path, flags);
+	if (state->ep[number] < 0)
 	{
-		perror("Failed to open ep2");
+		fprintf(stderr, "Failed to open ep%u: %s\n", number, strerror(errno));
 		return false;
 	}
 	else
 	{
-		DEBUG_PRINT("Opened ep2 :-)\n");
+		DEBUG_PRINT("Opened ep%u :-)\n", number);
 	}
 
-	/* Free endpoint path buffer */
-	free(ep_path);
-	ep_path = NULL;
-
 	return true;
 }
 
 static void close_endpoints(state_t *state)
 {
-	/* Close endpoints */
+	/* Close every endpoint opened (bulk endpoints of later interfaces follow the event endpoint) */
 	for (unsigned int i = 0; i < ARRAY_SIZE(state->ep); i++)
 	{
-		close(state->ep[i]);
+		if (state->ep[i] >= 0)
+		{
+			close(state->ep[i]);
+			state->ep[i] = -1;
+		}
 	}
 }
 
@@ -555,12 +1070,78 @@ static void signal_handler(int signum)
 	keep_running = 0;
 }
 
+static void dump_trace_handler(int signum)
+{
+	(void)signum;
+
+	/* Flag dump required, performed by main loop */
+	dump_trace = 1;
+}
+
+static bool parse_device_option(char *option, const char *devices[SDR_USB_GADGET_MAX_INTERFACES])
+{
+	/* Device for a single interface given as INTERFACE=NAME, otherwise NAME applies to all */
+	char *separator = strchr(option, '=');
+	if (!separator)
+	{
+		for (unsigned int i = 0; i < SDR_USB_GADGET_MAX_INTERFACES; i++)
+		{
+			devices[i] = option;
+		}
+		return true;
+	}
+
+	char *end;
+	unsigned long interface = strtoul(option, &end, 0);
+	if ((end != separator) || (interface >= SDR_USB_GADGET_MAX_INTERFACES))
+	{
+		fprintf(stderr, "Error: Bad interface in device option: %s\n", option);
+		return false;
+	}
+	devices[interface] = separator + 1;
+
+	return true;
+}
+
+static void warn_shared_devices(const char *devices[SDR_USB_GADGET_MAX_INTERFACES], unsigned int count, const char *name)
+{
+	/* IIO allows a single buffer per device, such that streams sharing a device can't run concurrently */
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = i + 1; j < count; j++)
+		{
+			if (0 != strcmp(devices[i], devices[j]))
+				continue;
+
+			/* Automatic selection resolves to the same (first) device for every interface */
+			if (0 == strcmp(devices[i], DEVICE_SELECT_AUTO))
+			{
+				printf("Warning: Interfaces %u and %u both select %s device %s, resolving to the same device, only one can stream at a time\n", i, j, name, devices[i]);
+			}
+			else
+			{
+				printf("Warning: Interfaces %u and %u share %s device %s, only one can stream at a time\n", i, j, name, devices[i]);
+			}
+		}
+	}
+}
+
 static void print_usage(const char *program_name, FILE *dest)
 {
 	fprintf(dest, "Usage: %s [OPTIONS] FFS_DIRECTORY\n", program_name);
 	fprintf(dest, "OPTIONS:\n");
 	fprintf(dest, "  -h, --help\tDisplay this help message\n");
 	fprintf(dest, "  -d, --debug\tEnable debug output\n");
+	fprintf(dest, "  -c, --cumulative-stats\tDon't reset stats each period (requires GENERATE_STATS)\n");
+	fprintf(dest, "  -t, --trace RECORDS\tTrace buffer lifecycle, keeping the last RECORDS per thread (dump with SIGUSR1)\n");
+	fprintf(dest, "  -T, --trace-file PATH\tTrace dump file (default: " DEFAULT_TRACE_FILE ")\n");
+	fprintf(dest, "  -s, --superspeed\tProvide SuperSpeed descriptors\n");
+	fprintf(dest, "  -b, --max-burst N\tSuperSpeed bulk endpoint burst (packets - 1, 0 - 15, default: 0)\n");
+	fprintf(dest, "  -S, --max-streams N\tSuperSpeed bulk endpoint streams advertised (log2, 0 - 16, default: 0)\n");
+	fprintf(dest, "  -n, --interfaces N\tProvide N interfaces, each with a bulk endpoint pair (1 - %u, default: 1)\n", SDR_USB_GADGET_MAX_INTERFACES);
+	fprintf(dest, "  -r, --rx-device [INTERFACE=]NAME\tIIO device to stream RX from, by name / id or \"auto\", for all interfaces or the one given (default: " DEVICE_SELECT_DEFAULT_RX ")\n");
+	fprintf(dest, "  -x, --tx-device [INTERFACE=]NAME\tIIO device to stream TX to, by name / id or \"auto\", for all interfaces or the one given (default: " DEVICE_SELECT_DEFAULT_TX ")\n");
+	fprintf(dest, "  -i, --isochronous MULT\tMake the first interface's endpoints isochronous, MULT x 1024 bytes per microframe (1 - 3)\n");
 	fprintf(dest, "  -v, --version\tDisplay the version of the program\n");
 }
 
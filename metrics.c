@@ -0,0 +1,94 @@
+/* Public header file */
+#include "metrics.h"
+
+/* Standard / system libraries */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Private variables */
+static bool shared;
+
+/* Public functions */
+METRICS_Shared_t *METRICS_Init(uint32_t num_interfaces)
+{
+	METRICS_Shared_t *metrics = MAP_FAILED;
+
+	/* Create shared memory object, readable by all */
+	int fd = shm_open(METRICS_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		perror("Failed to open shared metrics");
+	}
+	else
+	{
+		/* Size and map object */
+		if (ftruncate(fd, sizeof(METRICS_Shared_t)) < 0)
+		{
+			perror("Failed to size shared metrics");
+		}
+		else
+		{
+			metrics = mmap(NULL, sizeof(METRICS_Shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (MAP_FAILED == metrics)
+			{
+				perror("Failed to map shared metrics");
+			}
+		}
+
+		/* Mapping persists after close */
+		close(fd);
+	}
+
+	if (MAP_FAILED == metrics)
+	{
+		/* Fall back to private memory, such that counters remain available to the daemon itself */
+		metrics = aligned_alloc(METRICS_CACHE_LINE_SIZE, sizeof(METRICS_Shared_t));
+		if (!metrics)
+		{
+			perror("Failed to allocate metrics");
+			return NULL;
+		}
+		shared = false;
+	}
+	else
+	{
+		shared = true;
+	}
+
+	/* Reset counters */
+	memset(metrics, 0x00, sizeof(*metrics));
+
+	/* Populate header, magic last such that readers only accept a complete header */
+	metrics->version = METRICS_VERSION;
+	metrics->size = sizeof(*metrics);
+	metrics->pid = (uint32_t)getpid();
+	metrics->num_interfaces = num_interfaces;
+	atomic_thread_fence(memory_order_release);
+	metrics->magic = METRICS_MAGIC;
+
+	return metrics;
+}
+
+void METRICS_Deinit(METRICS_Shared_t *metrics)
+{
+	if (!metrics)
+		return;
+
+	if (shared)
+	{
+		/* Unmap and remove object */
+		munmap(metrics, sizeof(*metrics));
+		shm_unlink(METRICS_SHM_NAME);
+	}
+	else
+	{
+		/* Free private memory */
+		free(metrics);
+	}
+}
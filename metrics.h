@@ -0,0 +1,140 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* Standard libraries */
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
+/* Definitions */
+#define METRICS_SHM_NAME "/sdr_usb_gadget_metrics"
+#define METRICS_MAGIC (0x53444D54) /* "SDMT" */
+#define METRICS_VERSION (7)
+#define METRICS_CACHE_LINE_SIZE (64)
+
+/*
+** Type definitions - per thread counters
+** Each block is written by a single streaming thread and read by anyone mapping the shared memory object.
+** Blocks are aligned to a cache line such that the RX and TX threads never contend for the same line.
+*/
+typedef struct
+{
+	/* Bytes transferred over USB */
+	_Alignas(METRICS_CACHE_LINE_SIZE) atomic_uint_least64_t bytes;
+
+	/* Buffers transferred over USB */
+	atomic_uint_least64_t buffers;
+
+	/* Buffers dropped as no USB buffer was free (RX) */
+	atomic_uint_least64_t overflows;
+
+	/* Buffers not transferred in full to / from IIO (TX short push) */
+	atomic_uint_least64_t underruns;
+
+	/* Buffers dropped as their timestamp had passed (TX) */
+	atomic_uint_least64_t late;
+
+	/* Isochronous transfers which failed, reported rather than retried */
+	atomic_uint_least64_t lost;
+
+	/* Test pattern discontinuities / corrupt words received (TX) */
+	atomic_uint_least64_t gaps;
+	atomic_uint_least64_t corrupt;
+
+	/* AIO submissions / completions which failed */
+	atomic_uint_least64_t aio_errors;
+
+	/* AIO completions aborted by configuration being disabled */
+	atomic_uint_least64_t shutdowns;
+
+	/* Digital loopback marker, first non-zero sample pushed (TX) / received (RX), its index and time (uS, zero until found) */
+	atomic_uint_least64_t marker_sample;
+	atomic_uint_least64_t marker_time;
+
+	/* Thread state (SDR_USB_GADGET_STREAM_STATE_*) */
+	atomic_uint_least32_t state;
+
+	/* Negotiated configuration, valid while running */
+	atomic_uint_least32_t enabled_channels;
+	atomic_uint_least32_t buffer_size;
+	atomic_uint_least32_t usb_buffer_size;
+	atomic_uint_least32_t queue_depth;
+
+} METRICS_Thread_t;
+
+/* Type definitions - per interface counters */
+typedef struct
+{
+	METRICS_Thread_t rx;
+	METRICS_Thread_t tx;
+
+} METRICS_Interface_t;
+
+/* Type definitions - shared memory snapshot */
+typedef struct
+{
+	/* Header, identifying layout */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+
+	/* Process ID of publisher */
+	uint32_t pid;
+
+	/* Number of interfaces provided */
+	uint32_t num_interfaces;
+
+	/* Per thread counters, for each interface */
+	METRICS_Interface_t interfaces[SDR_USB_GADGET_MAX_INTERFACES];
+
+} METRICS_Shared_t;
+
+/* Create / map shared metrics for the interfaces provided, falling back to private memory if shared memory isn't available */
+METRICS_Shared_t *METRICS_Init(uint32_t num_interfaces);
+
+/* Unmap and remove shared metrics */
+void METRICS_Deinit(METRICS_Shared_t *metrics);
+
+/* Increment counter (counters have a single writer, so avoid the cost of an atomic read-modify-write) */
+static inline void METRICS_Add(atomic_uint_least64_t *counter, uint64_t value)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/* Set thread state */
+static inline void METRICS_SetState(METRICS_Thread_t *metrics, uint32_t state)
+{
+	atomic_store_explicit(&metrics->state, state, memory_order_release);
+}
+
+/* Publish negotiated configuration */
+static inline void METRICS_SetConfig(METRICS_Thread_t *metrics, uint32_t enabled_channels, uint32_t buffer_size, uint32_t usb_buffer_size, uint32_t queue_depth)
+{
+	atomic_store_explicit(&metrics->enabled_channels, enabled_channels, memory_order_relaxed);
+	atomic_store_explicit(&metrics->buffer_size, buffer_size, memory_order_relaxed);
+	atomic_store_explicit(&metrics->usb_buffer_size, usb_buffer_size, memory_order_relaxed);
+	atomic_store_explicit(&metrics->queue_depth, queue_depth, memory_order_relaxed);
+}
+
+/* Publish marker, its time being written last such that a reader seeing the time sees the sample index */
+static inline void METRICS_SetMarker(METRICS_Thread_t *metrics, uint64_t sample, uint64_t time)
+{
+	atomic_store_explicit(&metrics->marker_sample, sample, memory_order_relaxed);
+	atomic_store_explicit(&metrics->marker_time, time, memory_order_release);
+}
+
+/* Read marker time (zero if not yet found) */
+static inline uint64_t METRICS_GetMarkerTime(const METRICS_Thread_t *metrics)
+{
+	return atomic_load_explicit(&metrics->marker_time, memory_order_acquire);
+}
+
+/* Read counter */
+static inline uint64_t METRICS_Read(const atomic_uint_least64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,223 @@
+/* Public header */
+#include "notify.h"
+
+/* Standard / system libraries */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Macros */
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Private functions */
+static void collect_events(NOTIFY_Ctx_t *ctx);
+static int send_next_event(NOTIFY_Ctx_t *ctx);
+
+/* Public functions */
+bool NOTIFY_Init(NOTIFY_Ctx_t *ctx, int ep_fd)
+{
+	/* Reset context */
+	memset(ctx, 0x00, sizeof(*ctx));
+	ctx->ep_fd = ep_fd;
+
+	/* Prepare eventfd for sources to wake us */
+	ctx->wake_fd = eventfd(0, 0);
+	if (ctx->wake_fd < 0)
+	{
+		perror("Failed to open notify eventfd");
+		return false;
+	}
+
+	/* Setup AIO context, with a single transfer in flight */
+	if (io_setup(1, &ctx->io_ctx) < 0)
+	{
+		perror("Failed to setup notify AIO");
+		return false;
+	}
+	ctx->aio_eventfd = eventfd(0, 0);
+	if (ctx->aio_eventfd < 0)
+	{
+		perror("Failed to open notify AIO eventfd");
+		return false;
+	}
+
+	/* Prepare sources, alternating RX / TX for each interface */
+	for (unsigned int i = 0; i < ARRAY_SIZE(ctx->sources); i++)
+	{
+		ctx->sources[i].target = (i & 1) ? SDR_USB_GADGET_COMMAND_TARGET_TX : SDR_USB_GADGET_COMMAND_TARGET_RX;
+		ctx->sources[i].interface = (uint8_t)(i / 2);
+		ctx->sources[i].wake_fd = ctx->wake_fd;
+	}
+
+	return true;
+}
+
+void NOTIFY_Deinit(NOTIFY_Ctx_t *ctx)
+{
+	/* Destroy IO context (cancelling any pending transfer) */
+	io_destroy(ctx->io_ctx);
+	close(ctx->aio_eventfd);
+	close(ctx->wake_fd);
+}
+
+void NOTIFY_Post(NOTIFY_Source_t *source, uint8_t type, uint64_t sample)
+{
+	uint32_t head = atomic_load_explicit(&source->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&source->tail, memory_order_acquire);
+
+	/* Drop event if queue is full (consumer is behind, counters remain available via GET_STATS) */
+	if ((head - tail) >= NOTIFY_QUEUE_SIZE)
+		return;
+
+	/* Fill event and publish */
+	cmd_usb_event_t *event = &source->events[head % NOTIFY_QUEUE_SIZE];
+	event->type = type;
+	event->target = source->target;
+	event->count = 1;
+	event->interface = source->interface;
+	event->reserved = 0;
+	event->sample = sample;
+	atomic_store_explicit(&source->head, head + 1, memory_order_release);
+
+	/* Wake consumer unless a wake is already pending, the fence pairing with collect_events() such that either it sees the new head or we see the pending flag cleared */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_exchange_explicit(&source->wake_pending, true, memory_order_relaxed))
+	{
+		uint64_t eventfd_val = 0x1;
+		if (write(source->wake_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
+		{
+			perror("Failed to write notify eventfd");
+		}
+	}
+}
+
+int NOTIFY_HandleWake(NOTIFY_Ctx_t *ctx)
+{
+	/* Read eventfd to reset it */
+	uint64_t dummy;
+	if (read(ctx->wake_fd, &dummy, sizeof(dummy)) < 0)
+	{
+		perror("Failed to read notify eventfd");
+		return -1;
+	}
+
+	/* Collect events from sources */
+	collect_events(ctx);
+
+	/* Start sending if idle */
+	return ctx->busy ? 0 : send_next_event(ctx);
+}
+
+int NOTIFY_HandleComplete(NOTIFY_Ctx_t *ctx)
+{
+	struct io_event event;
+
+	/* Read eventfd to reset it */
+	uint64_t dummy;
+	if (read(ctx->aio_eventfd, &dummy, sizeof(dummy)) < 0)
+	{
+		perror("Failed to read notify aio eventfd");
+		return -1;
+	}
+
+	/* Reap completion */
+	struct timespec timeout = {0, 0};
+	int ret = io_getevents(ctx->io_ctx, 1, 1, &event, &timeout);
+	if (ret < 0)
+	{
+		perror("Failed to read completed notify io event");
+		return -1;
+	}
+	else if (0 == ret)
+	{
+		return 0;
+	}
+
+	/* Events are best effort, only report unexpected failures */
+	if ((sizeof(ctx->record) != (size_t)event.res) && (-ESHUTDOWN != (long)event.res))
+	{
+		fprintf(stderr, "USB event write completed with error, res: %ld, res2: %ld\n", event.res, event.res2);
+	}
+	ctx->busy = false;
+
+	/* Collect any events posted while busy, then send next */
+	collect_events(ctx);
+	return send_next_event(ctx);
+}
+
+/* Private functions */
+static void collect_events(NOTIFY_Ctx_t *ctx)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(ctx->sources); i++)
+	{
+		NOTIFY_Source_t *source = &ctx->sources[i];
+
+		/* Re-arm wake before reading head, events posted after this being either collected now or waking us again */
+		atomic_store_explicit(&source->wake_pending, false, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		uint32_t head = atomic_load_explicit(&source->head, memory_order_acquire);
+		uint32_t tail = atomic_load_explicit(&source->tail, memory_order_relaxed);
+
+		for (; tail != head; tail++)
+		{
+			const cmd_usb_event_t *event = &source->events[tail % NOTIFY_QUEUE_SIZE];
+			if (event->type >= SDR_USB_GADGET_EVENT_COUNT)
+				continue;
+
+			/* Coalesce with pending event of the same type, keeping sample of the first */
+			cmd_usb_event_t *pending = &ctx->pending[i][event->type];
+			if (0 == pending->count)
+			{
+				*pending = *event;
+				ctx->pending_order[i][event->type] = ctx->next_order++;
+			}
+			else if (pending->count < UINT16_MAX)
+			{
+				pending->count++;
+			}
+		}
+
+		/* Release queue entries */
+		atomic_store_explicit(&source->tail, tail, memory_order_release);
+	}
+}
+
+static int send_next_event(NOTIFY_Ctx_t *ctx)
+{
+	/* Find oldest pending event */
+	cmd_usb_event_t *next = NULL;
+	uint32_t next_order = 0;
+	for (unsigned int i = 0; i < ARRAY_SIZE(ctx->pending); i++)
+	{
+		for (unsigned int j = 0; j < ARRAY_SIZE(ctx->pending[i]); j++)
+		{
+			if ((ctx->pending[i][j].count > 0) && (!next || ((int32_t)(ctx->pending_order[i][j] - next_order) < 0)))
+			{
+				next = &ctx->pending[i][j];
+				next_order = ctx->pending_order[i][j];
+			}
+		}
+	}
+	if (!next)
+		return 0;
+
+	/* Move into transmit record, freeing the pending slot for further coalescing */
+	ctx->record = *next;
+	next->count = 0;
+
+	/* Submit write, completing when the host polls the endpoint */
+	struct iocb *iocb = &ctx->iocb;
+	io_prep_pwrite(iocb, ctx->ep_fd, &ctx->record, sizeof(ctx->record), 0);
+	io_set_eventfd(iocb, ctx->aio_eventfd);
+	if (1 != io_submit(ctx->io_ctx, 1, &iocb))
+	{
+		/* Endpoint may not be enabled, drop event */
+		perror("Failed to submit usb event");
+		return 0;
+	}
+	ctx->busy = true;
+
+	return 0;
+}
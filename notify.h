@@ -0,0 +1,92 @@
+#ifndef __NOTIFY_H__
+#define __NOTIFY_H__
+
+/* Standard libraries */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* AsyncIO library */
+#include "libaio.h"
+
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
+/* Definitions */
+#define NOTIFY_QUEUE_SIZE (32)
+#define NOTIFY_CACHE_LINE_SIZE (64)
+
+/* Type definitions - event source, posted to by a single streaming thread */
+typedef struct
+{
+	/* Queued events */
+	cmd_usb_event_t events[NOTIFY_QUEUE_SIZE];
+
+	/* Events posted (written by streaming thread) */
+	_Alignas(NOTIFY_CACHE_LINE_SIZE) atomic_uint_least32_t head;
+
+	/* Events consumed (written by main thread) */
+	_Alignas(NOTIFY_CACHE_LINE_SIZE) atomic_uint_least32_t tail;
+
+	/* Wake written and not yet collected (set by streaming thread, cleared by main thread before collecting) */
+	atomic_bool wake_pending;
+
+	/* Target / interface reported in events */
+	uint8_t target;
+	uint8_t interface;
+
+	/* Eventfd to wake consumer */
+	int wake_fd;
+
+} NOTIFY_Source_t;
+
+/* Type definitions - context, owned by main thread */
+typedef struct
+{
+	/* Interrupt endpoint */
+	int ep_fd;
+
+	/* Eventfd written by sources when posting */
+	int wake_fd;
+
+	/* AIO context / completion eventfd */
+	io_context_t io_ctx;
+	int aio_eventfd;
+
+	/* Sources (RX, TX of each interface) */
+	NOTIFY_Source_t sources[SDR_USB_GADGET_MAX_INTERFACES * 2];
+
+	/* Events awaiting transmission, coalesced by source and type. Order records when each was first queued */
+	cmd_usb_event_t pending[SDR_USB_GADGET_MAX_INTERFACES * 2][SDR_USB_GADGET_EVENT_COUNT];
+	uint32_t pending_order[SDR_USB_GADGET_MAX_INTERFACES * 2][SDR_USB_GADGET_EVENT_COUNT];
+	uint32_t next_order;
+
+	/* Event being transmitted */
+	bool busy;
+	struct iocb iocb;
+	cmd_usb_event_t record;
+
+} NOTIFY_Ctx_t;
+
+/* Prepare context for interrupt endpoint */
+bool NOTIFY_Init(NOTIFY_Ctx_t *ctx, int ep_fd);
+
+/* Destroy context, cancelling any pending transfer */
+void NOTIFY_Deinit(NOTIFY_Ctx_t *ctx);
+
+/* Retrieve source of interface's RX / TX thread */
+static inline NOTIFY_Source_t *NOTIFY_GetSource(NOTIFY_Ctx_t *ctx, unsigned int interface, bool tx)
+{
+	return &ctx->sources[(interface * 2) + (tx ? 1 : 0)];
+}
+
+/* Post event from streaming thread (lock free, events are dropped if the queue is full) */
+void NOTIFY_Post(NOTIFY_Source_t *source, uint8_t type, uint64_t sample);
+
+/* Handle wake_fd becoming readable, collecting posted events */
+int NOTIFY_HandleWake(NOTIFY_Ctx_t *ctx);
+
+/* Handle aio_eventfd becoming readable, sending next event */
+int NOTIFY_HandleComplete(NOTIFY_Ctx_t *ctx);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+** Static (USDT) probes for use with perf / bpftrace, for example:
+**   bpftrace -e 'usdt:/usr/sbin/sdr_usb_gadget:sdr_usb_gadget:rx_overflow { @[arg0] = count(); }'
+** Each probe compiles to a single nop unless attached to, or to nothing when built without USDT support.
+*/
+
+#ifndef ENABLE_USDT
+#define ENABLE_USDT (0)
+#endif
+
+#if ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(sdr_usb_gadget, name)
+#define PROBE1(name, a) DTRACE_PROBE1(sdr_usb_gadget, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(sdr_usb_gadget, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(sdr_usb_gadget, name, a, b, c)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { (void)(a); } while (0)
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/* Public header */
+#include "sample_format.h"
+
+/* Standard / system libraries */
+#include <string.h>
+
+/* NEON intrinsics */
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(SAMPLE_FORMAT_NEON)
+#error "NEON sample format kernels requested, but the compiler isn't targeting NEON"
+#endif
+
+/* Definitions */
+#define NEON_LANES (8) /* 16-bit lanes per quad register */
+#define INT8_MAX_MAGNITUDE (127)
+
+/* Public functions */
+void SAMPLE_FORMAT_Deinterleave16(int16_t *dest, const int16_t *src, unsigned int num_channels, size_t samples)
+{
+	size_t i = 0;
+
+	/* Nothing to de-interleave */
+	if (1 == num_channels)
+	{
+		memcpy(dest, src, samples * sizeof(*src));
+		return;
+	}
+
+	#if defined(__ARM_NEON)
+	/* Common channel counts (one / two I/Q pairs), structure loads splitting eight samples at a time */
+	if (2 == num_channels)
+	{
+		for (; (i + NEON_LANES) <= samples; i += NEON_LANES)
+		{
+			int16x8x2_t v = vld2q_s16(src + (2 * i));
+			vst1q_s16(dest + i, v.val[0]);
+			vst1q_s16(dest + samples + i, v.val[1]);
+		}
+	}
+	else if (4 == num_channels)
+	{
+		for (; (i + NEON_LANES) <= samples; i += NEON_LANES)
+		{
+			int16x8x4_t v = vld4q_s16(src + (4 * i));
+			vst1q_s16(dest + i, v.val[0]);
+			vst1q_s16(dest + samples + i, v.val[1]);
+			vst1q_s16(dest + (2 * samples) + i, v.val[2]);
+			vst1q_s16(dest + (3 * samples) + i, v.val[3]);
+		}
+	}
+	#endif
+
+	/* Remaining samples (or all, for other channel counts / without NEON) */
+	for (; i < samples; i++)
+	{
+		for (unsigned int c = 0; c < num_channels; c++)
+		{
+			dest[(c * samples) + i] = src[(i * num_channels) + c];
+		}
+	}
+}
+
+void SAMPLE_FORMAT_Interleave16(int16_t *dest, const int16_t *src, unsigned int num_channels, size_t samples)
+{
+	size_t i = 0;
+
+	/* Nothing to interleave */
+	if (1 == num_channels)
+	{
+		memcpy(dest, src, samples * sizeof(*src));
+		return;
+	}
+
+	#if defined(__ARM_NEON)
+	/* Common channel counts, structure stores merging eight samples at a time */
+	if (2 == num_channels)
+	{
+		for (; (i + NEON_LANES) <= samples; i += NEON_LANES)
+		{
+			int16x8x2_t v;
+			v.val[0] = vld1q_s16(src + i);
+			v.val[1] = vld1q_s16(src + samples + i);
+			vst2q_s16(dest + (2 * i), v);
+		}
+	}
+	else if (4 == num_channels)
+	{
+		for (; (i + NEON_LANES) <= samples; i += NEON_LANES)
+		{
+			int16x8x4_t v;
+			v.val[0] = vld1q_s16(src + i);
+			v.val[1] = vld1q_s16(src + samples + i);
+			v.val[2] = vld1q_s16(src + (2 * samples) + i);
+			v.val[3] = vld1q_s16(src + (3 * samples) + i);
+			vst4q_s16(dest + (4 * i), v);
+		}
+	}
+	#endif
+
+	/* Remaining samples (or all, for other channel counts / without NEON) */
+	for (; i < samples; i++)
+	{
+		for (unsigned int c = 0; c < num_channels; c++)
+		{
+			dest[(i * num_channels) + c] = src[(c * samples) + i];
+		}
+	}
+}
+
+void SAMPLE_FORMAT_Narrow8(int8_t *dest, const int16_t *src, size_t words, unsigned int shift)
+{
+	size_t i = 0;
+
+	#if defined(__ARM_NEON)
+	/* Shift by a negative count (arithmetic right shift), then saturating narrow, eight words at a time */
+	int16x8_t count = vdupq_n_s16(-(int16_t)shift);
+	for (; (i + NEON_LANES) <= words; i += NEON_LANES)
+	{
+		vst1_s8(dest + i, vqmovn_s16(vshlq_s16(vld1q_s16(src + i), count)));
+	}
+	#endif
+
+	/* Remaining words (or all, without NEON) */
+	for (; i < words; i++)
+	{
+		int16_t value = src[i] >> shift;
+		dest[i] = (value > INT8_MAX) ? INT8_MAX : ((value < INT8_MIN) ? INT8_MIN : value);
+	}
+}
+
+unsigned int SAMPLE_FORMAT_BlockShift8(const int16_t *src, size_t words)
+{
+	size_t i = 0;
+	uint16_t magnitudes = 0;
+
+	/* Only the highest bit set in any word's magnitude matters, so OR together magnitudes (one's complement of negative words) */
+	#if defined(__ARM_NEON)
+	uint16x8_t acc = vdupq_n_u16(0);
+	for (; (i + NEON_LANES) <= words; i += NEON_LANES)
+	{
+		int16x8_t v = vld1q_s16(src + i);
+		acc = vorrq_u16(acc, vreinterpretq_u16_s16(veorq_s16(v, vshrq_n_s16(v, 15))));
+	}
+	uint16x4_t half = vorr_u16(vget_low_u16(acc), vget_high_u16(acc));
+	magnitudes = vget_lane_u16(half, 0) | vget_lane_u16(half, 1) | vget_lane_u16(half, 2) | vget_lane_u16(half, 3);
+	#endif
+
+	/* Remaining words (or all, without NEON) */
+	for (; i < words; i++)
+	{
+		magnitudes |= (uint16_t)(src[i] ^ (src[i] >> 15));
+	}
+
+	unsigned int shift = 0;
+	while ((magnitudes >> shift) > INT8_MAX_MAGNITUDE)
+	{
+		shift++;
+	}
+
+	return shift;
+}
@@ -0,0 +1,25 @@
+#ifndef __SAMPLE_FORMAT_H__
+#define __SAMPLE_FORMAT_H__
+
+/* Standard libraries */
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Conversions between IIO's interleaved layout (a 16-bit word per channel per sample) and wire formats, each
+** performed as the single copy between IIO and USB buffers. NEON kernels are used when built for NEON.
+*/
+
+/* De-interleave samples into a block per channel (channel 0's samples, then channel 1's...) */
+void SAMPLE_FORMAT_Deinterleave16(int16_t *dest, const int16_t *src, unsigned int num_channels, size_t samples);
+
+/* Interleave a block per channel into samples */
+void SAMPLE_FORMAT_Interleave16(int16_t *dest, const int16_t *src, unsigned int num_channels, size_t samples);
+
+/* Shift words right (arithmetic) and narrow to 8 bits, saturating */
+void SAMPLE_FORMAT_Narrow8(int8_t *dest, const int16_t *src, size_t words, unsigned int shift);
+
+/* Smallest shift narrowing every word without saturating (block floating point exponent, 0 to 8) */
+unsigned int SAMPLE_FORMAT_BlockShift8(const int16_t *src, size_t words);
+
+#endif
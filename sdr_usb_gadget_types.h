@@ -4,12 +4,119 @@
 /* Standard libraries */
 #include <stdint.h>
 
+/* Definitions - protocol version, reported by GET_CAPABILITIES */
+#define SDR_USB_GADGET_PROTOCOL_VERSION (0x0001)
+
 /* Definitions - commands */
 #define SDR_USB_GADGET_COMMAND_START (0x10)
 #define SDR_USB_GADGET_COMMAND_STOP (0x11)
+#define SDR_USB_GADGET_COMMAND_START_TLV (0x12)
+#define SDR_USB_GADGET_COMMAND_GET_STATUS (0x20)
+#define SDR_USB_GADGET_COMMAND_GET_STATS (0x21)
+#define SDR_USB_GADGET_COMMAND_GET_CAPABILITIES (0x22)
 #define SDR_USB_GADGET_COMMAND_TARGET_RX (0x00)
 #define SDR_USB_GADGET_COMMAND_TARGET_TX (0x01)
 
+/*
+** Definitions - interfaces
+** Each interface provides a bulk IN (RX) / bulk OUT (TX) endpoint pair, streamed by its own RX / TX threads.
+** Interface 0 additionally provides the interrupt IN endpoint, carrying events for all interfaces.
+** Requests are directed at an interface by wIndex (recipient interface), wValue selecting RX / TX as before.
+*/
+#define SDR_USB_GADGET_MAX_INTERFACES (4)
+
+/* Definitions - stream states */
+#define SDR_USB_GADGET_STREAM_STATE_STOPPED (0x00)
+#define SDR_USB_GADGET_STREAM_STATE_STARTING (0x01)
+#define SDR_USB_GADGET_STREAM_STATE_RUNNING (0x02)
+#define SDR_USB_GADGET_STREAM_STATE_ERROR (0x03)
+
+/* Definitions - events sent on interrupt IN endpoint */
+#define SDR_USB_GADGET_EVENT_OVERFLOW (0x01)
+#define SDR_USB_GADGET_EVENT_UNDERRUN (0x02)
+#define SDR_USB_GADGET_EVENT_STREAM_ERROR (0x03)
+#define SDR_USB_GADGET_EVENT_STREAM_STARTED (0x04)
+#define SDR_USB_GADGET_EVENT_STREAM_STOPPED (0x05)
+#define SDR_USB_GADGET_EVENT_LATE (0x06)
+#define SDR_USB_GADGET_EVENT_LOSS (0x07)
+#define SDR_USB_GADGET_EVENT_COUNT (0x08)
+
+/* Definitions - START_TLV tags, values are little endian */
+#define SDR_USB_GADGET_TLV_ENABLED_CHANNELS (0x0001) /* uint32_t, bitmask of enabled channels (required) */
+#define SDR_USB_GADGET_TLV_BUFFER_SIZE (0x0002) /* uint32_t, buffer size in samples (required) */
+#define SDR_USB_GADGET_TLV_WIRE_FORMAT (0x0003) /* uint32_t, SDR_USB_GADGET_WIRE_FORMAT_* */
+#define SDR_USB_GADGET_TLV_QUEUE_DEPTH (0x0004) /* uint32_t, number of USB transfers to queue */
+#define SDR_USB_GADGET_TLV_TIMESTAMPS (0x0005) /* uint32_t, non-zero to prefix each buffer with a timestamp */
+#define SDR_USB_GADGET_TLV_CYCLIC (0x0006) /* uint32_t, non-zero to repeat each uploaded TX buffer until the next */
+#define SDR_USB_GADGET_TLV_UNDERRUN_POLICY (0x0007) /* uint32_t, SDR_USB_GADGET_UNDERRUN_POLICY_* (TX) */
+#define SDR_USB_GADGET_TLV_PREFILL (0x0008) /* uint32_t, buffers to accumulate before starting / after an underrun (TX) */
+#define SDR_USB_GADGET_TLV_DEVICE (0x0009) /* char[], IIO device name / id, or "auto" (not null terminated, up to 63 chars) */
+#define SDR_USB_GADGET_TLV_TEST_PATTERN (0x000a) /* uint32_t, SDR_USB_GADGET_TEST_PATTERN_* generated (RX) / checked (TX) in place of IIO */
+#define SDR_USB_GADGET_TLV_TEST_RATE (0x000b) /* uint32_t, test pattern rate in samples per second (RX, zero for unpaced) */
+#define SDR_USB_GADGET_TLV_LOOPBACK (0x000c) /* uint32_t, SDR_USB_GADGET_LOOPBACK_* sending received transfers back out (TX) */
+#define SDR_USB_GADGET_TLV_DIGITAL_LOOPBACK (0x000d) /* uint32_t, non-zero to loop the DAC back to the ADC within the AD9361 (RX) */
+
+/* Definitions - wire formats (capabilities report a bitmask of (1 << format)) */
+#define SDR_USB_GADGET_WIRE_FORMAT_IIO (0x00) /* Samples as provided / consumed by IIO */
+#define SDR_USB_GADGET_WIRE_FORMAT_PLANAR (0x01) /* Block of 16-bit words per enabled channel (all of the first's samples, then the next's..) */
+#define SDR_USB_GADGET_WIRE_FORMAT_INT8 (0x02) /* RX only, 8-bit words (IIO words shifted right to their 8 most significant bits, saturating) */
+#define SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP (0x03) /* RX only, 8-bit words scaled per buffer (shift in first byte of sample preceding them) */
+
+/*
+** Definitions - timestamps
+** When enabled, each buffer starts with a little endian 64-bit sample index (since stream start), padded to a whole
+** number of samples (as described for cmd_usb_start_request_t buffer_size). RX buffers carry the index of their
+** first sample, which continues to advance while buffers are dropped on overflow. TX buffers are pushed to the DAC
+** at the sample index given, gaps being filled with zeros, while buffers whose time has passed are dropped.
+*/
+#define SDR_USB_GADGET_TIMESTAMP_SIZE (8)
+
+/* Definitions - TX underrun policies, applied when no buffer arrives within a buffer period */
+#define SDR_USB_GADGET_UNDERRUN_POLICY_NONE (0x00) /* DAC starves until the next buffer arrives */
+#define SDR_USB_GADGET_UNDERRUN_POLICY_ZERO (0x01) /* Push a buffer of zeros */
+#define SDR_USB_GADGET_UNDERRUN_POLICY_REPEAT (0x02) /* Push the last buffer again */
+#define SDR_USB_GADGET_UNDERRUN_POLICY_HOLD (0x03) /* Push a buffer of the last sample */
+
+/*
+** Definitions - test patterns
+** Streams of 16-bit little endian words, continuing across buffers (including those dropped on overflow) and
+** interleaved with any timestamps as usual. Unpaced streams generate a buffer whenever a USB transfer is free,
+** measuring the throughput of the transport alone. TX streams swallow received buffers, checking the pattern
+** continues from stream start (counter / PRBS), counting gaps and corrupt words in GET_STATS.
+*/
+#define SDR_USB_GADGET_TEST_PATTERN_NONE (0x00) /* Stream IIO device */
+#define SDR_USB_GADGET_TEST_PATTERN_COUNTER (0x01) /* Word count since stream start (wrapping) */
+#define SDR_USB_GADGET_TEST_PATTERN_PRBS (0x02) /* PRBS31 (x^31 + x^28 + 1, all ones seed), 16 bits per word LSB first */
+#define SDR_USB_GADGET_TEST_PATTERN_TONE (0x03) /* Full scale 12-bit tone at rate / 16, even channels I, odd Q */
+
+/*
+** Definitions - loopback modes
+** A TX stream may send each transfer received over its OUT endpoint back out of the RX IN endpoint as received,
+** in place of pushing it to IIO, the interface's RX stream having to be stopped. Looped back transfers are counted
+** in the RX stream's stats.
+*/
+#define SDR_USB_GADGET_LOOPBACK_NONE (0x00)
+#define SDR_USB_GADGET_LOOPBACK_COPY (0x01) /* Copy into a separate buffer, the OUT transfer being requeued at once */
+#define SDR_USB_GADGET_LOOPBACK_ZERO_COPY (0x02) /* Send from the OUT transfer's buffer, requeued once sent */
+
+/*
+** Definitions - digital loopback self-test
+** An RX stream started with digital loopback enables the AD9361's internal TX to RX digital loopback while it runs,
+** the host streaming TX as usual. The first non-zero sample pushed by the TX stream (from its start) is taken as a
+** marker, the RX stream searching buffers refilled after its push for the first non-zero sample. GET_STATS (RX) then
+** reports the offset between RX and TX sample indexes and the latency from the TX push to the RX refill.
+*/
+
+/* Definitions - I/O backends */
+#define SDR_USB_GADGET_IO_BACKEND_AIO (0x01) /* Linux AIO on FunctionFS endpoints */
+
+/* Definitions - bus speeds (matching kernel's enum usb_device_speed) */
+#define SDR_USB_GADGET_SPEED_UNKNOWN (0x00)
+#define SDR_USB_GADGET_SPEED_FULL (0x02)
+#define SDR_USB_GADGET_SPEED_HIGH (0x03)
+#define SDR_USB_GADGET_SPEED_SUPER (0x05)
+#define SDR_USB_GADGET_SPEED_SUPER_PLUS (0x06)
+
 /* Type definitions */
 #pragma pack(push,1)
 typedef struct
@@ -30,6 +137,138 @@ typedef struct
 	uint32_t buffer_size;
 
 } cmd_usb_start_request_t;
+
+/*
+** START_TLV request entry, target selected by wValue.
+** The request consists of a sequence of entries, each a header followed by length bytes of value.
+** Requests containing tags the gadget doesn't support (see capabilities) are rejected.
+*/
+typedef struct
+{
+	uint16_t tag;
+	uint16_t length;
+
+} cmd_usb_tlv_header_t;
+
+/* Response to GET_CAPABILITIES. Fields may be appended in later protocol versions, length reports the size sent */
+typedef struct
+{
+	/* Protocol version (SDR_USB_GADGET_PROTOCOL_VERSION) */
+	uint16_t protocol_version;
+
+	/* Size of this structure */
+	uint16_t length;
+
+	/* Bitmask of supported wire formats (1 << SDR_USB_GADGET_WIRE_FORMAT_*) */
+	uint32_t wire_formats;
+
+	/* Maximum number of USB transfers which may be queued */
+	uint32_t max_queue_depth;
+
+	/* Maximum size of each USB transfer (in bytes) */
+	uint32_t max_buffer_size;
+
+	/* Bitmask of available DSP stages (none currently defined) */
+	uint32_t dsp_stages;
+
+	/* I/O backend (SDR_USB_GADGET_IO_BACKEND_*) */
+	uint32_t io_backend;
+
+	/* Bitmask of supported START_TLV tags (1 << SDR_USB_GADGET_TLV_*) */
+	uint64_t tlv_tags;
+
+	/* Build version, null terminated */
+	char build_version[32];
+
+	/* Number of interfaces (streaming endpoint pairs) provided */
+	uint32_t num_interfaces;
+
+} cmd_usb_capabilities_response_t;
+
+/* Response to GET_STATUS, target selected by wValue */
+typedef struct
+{
+	/* Stream state (SDR_USB_GADGET_STREAM_STATE_*) */
+	uint32_t state;
+
+	/* Bitmask of enabled channels */
+	uint32_t enabled_channels;
+
+	/* Buffer size (in samples) */
+	uint32_t buffer_size;
+
+	/* Size of each USB transfer (in bytes) */
+	uint32_t usb_buffer_size;
+
+	/* Number of USB transfers queued */
+	uint32_t queue_depth;
+
+	/* Negotiated bus speed (SDR_USB_GADGET_SPEED_*) */
+	uint32_t usb_speed;
+
+	/* Endpoint max packet size at negotiated speed (in bytes, per (micro)frame if isochronous) */
+	uint32_t max_packet_size;
+
+} cmd_usb_status_response_t;
+
+/* Response to GET_STATS, target selected by wValue. Counters are cumulative since the gadget started */
+typedef struct
+{
+	/* Bytes / USB transfers completed */
+	uint64_t bytes;
+	uint64_t buffers;
+
+	/* RX buffers dropped as no USB transfer was available */
+	uint64_t overflows;
+
+	/* TX buffers not pushed in full */
+	uint64_t underruns;
+
+	/* USB transfers which failed */
+	uint64_t errors;
+
+	/* TX buffers dropped as their timestamp had passed */
+	uint64_t late;
+
+	/* Isochronous transfers lost (not retried) */
+	uint64_t lost;
+
+	/* TX test pattern discontinuities (data not continuing the pattern, resynchronised to) */
+	uint64_t gaps;
+
+	/* TX test pattern words received corrupt */
+	uint64_t corrupt;
+
+	/* Digital loopback self-test (RX), zero until the marker is received */
+	int64_t loopback_offset; /* RX sample index less TX sample index of marker */
+	uint64_t loopback_latency; /* uS from the TX buffer holding the marker being pushed to the RX buffer being refilled */
+
+} cmd_usb_stats_response_t;
+
+/*
+** Event sent on interrupt IN endpoint.
+** Events of the same type occuring while the host hasn't yet polled the endpoint are coalesced into a single record.
+*/
+typedef struct
+{
+	/* Event type (SDR_USB_GADGET_EVENT_*) */
+	uint8_t type;
+
+	/* Target (SDR_USB_GADGET_COMMAND_TARGET_*) */
+	uint8_t target;
+
+	/* Number of events coalesced into this record (saturating) */
+	uint16_t count;
+
+	/* Interface of target */
+	uint16_t interface;
+
+	uint16_t reserved;
+
+	/* Sample index (since stream start) of first event */
+	uint64_t sample;
+
+} cmd_usb_event_t;
 #pragma pack(pop)
 
 #endif
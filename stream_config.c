@@ -0,0 +1,361 @@
+/* Public header */
+#include "stream_config.h"
+
+/* Standard / system libraries */
+#include <stdio.h>
+#include <string.h>
+
+/* Definitions */
+#define TAG_BIT(x) (UINT64_C(1) << (x))
+#define SUPPORTED_TAGS (  TAG_BIT(SDR_USB_GADGET_TLV_ENABLED_CHANNELS) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_BUFFER_SIZE) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_WIRE_FORMAT) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_QUEUE_DEPTH) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_TIMESTAMPS) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_CYCLIC) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_UNDERRUN_POLICY) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_PREFILL) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_DEVICE) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_TEST_PATTERN) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_TEST_RATE) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_LOOPBACK) \
+						| TAG_BIT(SDR_USB_GADGET_TLV_DIGITAL_LOOPBACK) \
+						)
+#define REQUIRED_TAGS (TAG_BIT(SDR_USB_GADGET_TLV_ENABLED_CHANNELS) | TAG_BIT(SDR_USB_GADGET_TLV_BUFFER_SIZE))
+#define SUPPORTED_WIRE_FORMATS (  (1U << SDR_USB_GADGET_WIRE_FORMAT_IIO) \
+						| (1U << SDR_USB_GADGET_WIRE_FORMAT_PLANAR) \
+						| (1U << SDR_USB_GADGET_WIRE_FORMAT_INT8) \
+						| (1U << SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP) \
+						)
+
+/* Private functions */
+static void set_defaults(STREAM_CONFIG_Params_t *params, uint32_t default_queue_depth);
+static bool read_u32(const cmd_usb_tlv_header_t *header, const uint8_t *value, uint32_t *dest);
+static bool read_bool(const cmd_usb_tlv_header_t *header, const uint8_t *value, bool *dest);
+static bool read_string(const cmd_usb_tlv_header_t *header, const uint8_t *value, char *dest, size_t size);
+static bool validate(const STREAM_CONFIG_Params_t *params);
+
+/* Public functions */
+bool STREAM_CONFIG_ParseStart(const void *data, size_t length, uint32_t default_queue_depth, STREAM_CONFIG_Params_t *params)
+{
+	cmd_usb_start_request_t request;
+
+	/* Check request size */
+	if (length != sizeof(request))
+	{
+		printf("Bad start request, incorrect data size\n");
+		return false;
+	}
+	memcpy(&request, data, sizeof(request));
+
+	/* Apply request over defaults */
+	set_defaults(params, default_queue_depth);
+	params->enabled_channels = request.enabled_channels;
+	params->buffer_size = request.buffer_size;
+
+	return validate(params);
+}
+
+bool STREAM_CONFIG_ParseTLV(const void *data, size_t length, uint32_t default_queue_depth, STREAM_CONFIG_Params_t *params)
+{
+	const uint8_t *ptr = data;
+	uint64_t seen = 0;
+
+	/* Apply entries over defaults */
+	set_defaults(params, default_queue_depth);
+	while (length > 0)
+	{
+		/* Retrieve header */
+		cmd_usb_tlv_header_t header;
+		if (length < sizeof(header))
+		{
+			printf("Bad start request, truncated tlv header\n");
+			return false;
+		}
+		memcpy(&header, ptr, sizeof(header));
+		ptr += sizeof(header);
+		length -= sizeof(header);
+
+		/* Check value present */
+		if (length < header.length)
+		{
+			printf("Bad start request, truncated tlv value for tag 0x%04x\n", header.tag);
+			return false;
+		}
+
+		/* Act on tag */
+		bool ok;
+		switch (header.tag)
+		{
+			case SDR_USB_GADGET_TLV_ENABLED_CHANNELS:
+			{
+				ok = read_u32(&header, ptr, &params->enabled_channels);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_BUFFER_SIZE:
+			{
+				ok = read_u32(&header, ptr, &params->buffer_size);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_WIRE_FORMAT:
+			{
+				ok = read_u32(&header, ptr, &params->wire_format);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_QUEUE_DEPTH:
+			{
+				ok = read_u32(&header, ptr, &params->queue_depth);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_TIMESTAMPS:
+			{
+				ok = read_bool(&header, ptr, &params->timestamps);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_CYCLIC:
+			{
+				ok = read_bool(&header, ptr, &params->cyclic);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_UNDERRUN_POLICY:
+			{
+				ok = read_u32(&header, ptr, &params->underrun_policy);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_PREFILL:
+			{
+				ok = read_u32(&header, ptr, &params->prefill);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_DEVICE:
+			{
+				ok = read_string(&header, ptr, params->device, sizeof(params->device));
+				break;
+			}
+			case SDR_USB_GADGET_TLV_TEST_PATTERN:
+			{
+				ok = read_u32(&header, ptr, &params->test_pattern);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_TEST_RATE:
+			{
+				ok = read_u32(&header, ptr, &params->test_rate);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_LOOPBACK:
+			{
+				ok = read_u32(&header, ptr, &params->loopback);
+				break;
+			}
+			case SDR_USB_GADGET_TLV_DIGITAL_LOOPBACK:
+			{
+				ok = read_bool(&header, ptr, &params->digital_loopback);
+				break;
+			}
+			default:
+			{
+				/* Reject unknown tags, rather than starting in a mode the host didn't ask for */
+				printf("Bad start request, unsupported tlv tag 0x%04x\n", header.tag);
+				return false;
+			}
+		}
+		if (!ok)
+		{
+			printf("Bad start request, incorrect tlv length for tag 0x%04x\n", header.tag);
+			return false;
+		}
+		seen |= TAG_BIT(header.tag);
+
+		/* Move to next entry */
+		ptr += header.length;
+		length -= header.length;
+	}
+
+	/* Check required tags provided */
+	if (REQUIRED_TAGS != (seen & REQUIRED_TAGS))
+	{
+		printf("Bad start request, missing required tlv tags\n");
+		return false;
+	}
+
+	return validate(params);
+}
+
+bool STREAM_CONFIG_CheckTarget(const STREAM_CONFIG_Params_t *params, bool tx)
+{
+	if (!tx && (params->cyclic || (SDR_USB_GADGET_UNDERRUN_POLICY_NONE != params->underrun_policy) || (params->prefill > 0)))
+	{
+		printf("Bad start request, cyclic buffers, underrun policy and prefill are only supported for TX\n");
+		return false;
+	}
+	if (tx && (params->test_rate > 0))
+	{
+		printf("Bad start request, test rate is only supported for RX\n");
+		return false;
+	}
+	if (!tx && (SDR_USB_GADGET_LOOPBACK_NONE != params->loopback))
+	{
+		printf("Bad start request, loopback is only supported for TX\n");
+		return false;
+	}
+	if (tx && params->digital_loopback)
+	{
+		printf("Bad start request, digital loopback is only supported for RX\n");
+		return false;
+	}
+	if (tx && ((SDR_USB_GADGET_WIRE_FORMAT_INT8 == params->wire_format) || (SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP == params->wire_format)))
+	{
+		printf("Bad start request, 8-bit wire formats are only supported for RX\n");
+		return false;
+	}
+
+	return true;
+}
+
+uint32_t STREAM_CONFIG_TimestampSamples(size_t sample_size)
+{
+	/* Round up to whole samples */
+	return (SDR_USB_GADGET_TIMESTAMP_SIZE + sample_size - 1) / sample_size;
+}
+
+void STREAM_CONFIG_GetCapabilities(cmd_usb_capabilities_response_t *caps)
+{
+	memset(caps, 0x00, sizeof(*caps));
+	caps->protocol_version = SDR_USB_GADGET_PROTOCOL_VERSION;
+	caps->length = sizeof(*caps);
+	caps->wire_formats = SUPPORTED_WIRE_FORMATS;
+	caps->max_queue_depth = STREAM_CONFIG_MAX_QUEUE_DEPTH;
+	caps->max_buffer_size = STREAM_CONFIG_MAX_USB_BUFFER_SIZE;
+	caps->dsp_stages = 0;
+	caps->io_backend = SDR_USB_GADGET_IO_BACKEND_AIO;
+	caps->tlv_tags = SUPPORTED_TAGS;
+	strncpy(caps->build_version, PROGRAM_VERSION, sizeof(caps->build_version) - 1);
+}
+
+/* Private functions */
+static void set_defaults(STREAM_CONFIG_Params_t *params, uint32_t default_queue_depth)
+{
+	memset(params, 0x00, sizeof(*params));
+	params->wire_format = SDR_USB_GADGET_WIRE_FORMAT_IIO;
+	params->queue_depth = default_queue_depth;
+}
+
+static bool read_u32(const cmd_usb_tlv_header_t *header, const uint8_t *value, uint32_t *dest)
+{
+	if (sizeof(*dest) != header->length)
+		return false;
+
+	memcpy(dest, value, sizeof(*dest));
+
+	return true;
+}
+
+static bool read_bool(const cmd_usb_tlv_header_t *header, const uint8_t *value, bool *dest)
+{
+	uint32_t flag;
+	if (!read_u32(header, value, &flag))
+		return false;
+
+	*dest = (0 != flag);
+
+	return true;
+}
+
+static bool read_string(const cmd_usb_tlv_header_t *header, const uint8_t *value, char *dest, size_t size)
+{
+	/* Value isn't terminated, leave room for terminator */
+	if ((0 == header->length) || (header->length >= size))
+		return false;
+
+	memcpy(dest, value, header->length);
+	dest[header->length] = '\0';
+
+	/* Reject embedded terminators */
+	return (strlen(dest) == header->length);
+}
+
+static bool validate(const STREAM_CONFIG_Params_t *params)
+{
+	if (0 == params->enabled_channels)
+	{
+		printf("Bad start request, no channels enabled\n");
+		return false;
+	}
+	if (0 == params->buffer_size)
+	{
+		printf("Bad start request, zero buffer size\n");
+		return false;
+	}
+	if ((params->wire_format >= 32) || !(SUPPORTED_WIRE_FORMATS & (1U << params->wire_format)))
+	{
+		printf("Bad start request, unsupported wire format %u\n", params->wire_format);
+		return false;
+	}
+	if ((params->queue_depth < 1) || (params->queue_depth > STREAM_CONFIG_MAX_QUEUE_DEPTH))
+	{
+		printf("Bad start request, queue depth %u not within 1 - %u\n", params->queue_depth, STREAM_CONFIG_MAX_QUEUE_DEPTH);
+		return false;
+	}
+	if (params->cyclic && params->timestamps)
+	{
+		printf("Bad start request, cyclic buffers can't be timestamped\n");
+		return false;
+	}
+	if (params->underrun_policy > SDR_USB_GADGET_UNDERRUN_POLICY_HOLD)
+	{
+		printf("Bad start request, unsupported underrun policy %u\n", params->underrun_policy);
+		return false;
+	}
+	if ((SDR_USB_GADGET_UNDERRUN_POLICY_NONE != params->underrun_policy) && (params->cyclic || params->timestamps))
+	{
+		printf("Bad start request, underrun policy doesn't apply to cyclic or timestamped buffers\n");
+		return false;
+	}
+	if (params->prefill > params->queue_depth)
+	{
+		printf("Bad start request, prefill of %u exceeds queue depth of %u\n", params->prefill, params->queue_depth);
+		return false;
+	}
+	if ((params->prefill > 0) && (params->cyclic || params->timestamps))
+	{
+		printf("Bad start request, prefill doesn't apply to cyclic or timestamped buffers\n");
+		return false;
+	}
+	if (params->test_pattern > SDR_USB_GADGET_TEST_PATTERN_TONE)
+	{
+		printf("Bad start request, unsupported test pattern %u\n", params->test_pattern);
+		return false;
+	}
+	if ((params->test_rate > 0) && (SDR_USB_GADGET_TEST_PATTERN_NONE == params->test_pattern))
+	{
+		printf("Bad start request, test rate only applies to test patterns\n");
+		return false;
+	}
+	if ((SDR_USB_GADGET_TEST_PATTERN_NONE != params->test_pattern) && (params->cyclic || (SDR_USB_GADGET_UNDERRUN_POLICY_NONE != params->underrun_policy) || (params->prefill > 0)))
+	{
+		printf("Bad start request, cyclic buffers, underrun policy and prefill don't apply to test patterns\n");
+		return false;
+	}
+	if (params->loopback > SDR_USB_GADGET_LOOPBACK_ZERO_COPY)
+	{
+		printf("Bad start request, unsupported loopback mode %u\n", params->loopback);
+		return false;
+	}
+	if ((SDR_USB_GADGET_LOOPBACK_NONE != params->loopback) && (params->cyclic || params->timestamps || (SDR_USB_GADGET_UNDERRUN_POLICY_NONE != params->underrun_policy) || (params->prefill > 0) || (SDR_USB_GADGET_TEST_PATTERN_NONE != params->test_pattern)))
+	{
+		printf("Bad start request, loopback can't be combined with cyclic buffers, timestamps, underrun policy, prefill or test patterns\n");
+		return false;
+	}
+	if ((SDR_USB_GADGET_WIRE_FORMAT_IIO != params->wire_format) && ((SDR_USB_GADGET_TEST_PATTERN_NONE != params->test_pattern) || (SDR_USB_GADGET_LOOPBACK_NONE != params->loopback)))
+	{
+		printf("Bad start request, wire format %u requires streaming from / to IIO\n", params->wire_format);
+		return false;
+	}
+	if (params->digital_loopback && (SDR_USB_GADGET_TEST_PATTERN_NONE != params->test_pattern))
+	{
+		printf("Bad start request, digital loopback requires streaming from IIO\n");
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,79 @@
+#ifndef __STREAM_CONFIG_H__
+#define __STREAM_CONFIG_H__
+
+/* Standard libraries */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
+/* Definitions */
+#define STREAM_CONFIG_DEFAULT_QUEUE_DEPTH (16)
+#define STREAM_CONFIG_DEFAULT_QUEUE_DEPTH_SS (32)
+#define STREAM_CONFIG_DEFAULT_QUEUE_DEPTH_ISO (4)
+#define STREAM_CONFIG_MAX_QUEUE_DEPTH (64)
+#define STREAM_CONFIG_MAX_USB_BUFFER_SIZE (8 * 1024 * 1024)
+#define STREAM_CONFIG_MAX_DEVICE_NAME (64) /* Including terminator */
+
+/* Type definitions - stream configuration, as requested by START / START_TLV */
+typedef struct
+{
+	/* Bitmask of enabled channels */
+	uint32_t enabled_channels;
+
+	/* Buffer size (in samples) */
+	uint32_t buffer_size;
+
+	/* Wire format (SDR_USB_GADGET_WIRE_FORMAT_*) */
+	uint32_t wire_format;
+
+	/* Number of USB transfers to queue */
+	uint32_t queue_depth;
+
+	/* Prefix buffers with timestamp */
+	bool timestamps;
+
+	/* Repeat uploaded waveform (TX) */
+	bool cyclic;
+
+	/* Underrun policy (TX, SDR_USB_GADGET_UNDERRUN_POLICY_*) */
+	uint32_t underrun_policy;
+
+	/* Buffers to accumulate before pushing the first / after an underrun (TX, zero to disable) */
+	uint32_t prefill;
+
+	/* IIO device to stream from / to (empty for daemon's default) */
+	char device[STREAM_CONFIG_MAX_DEVICE_NAME];
+
+	/* Test pattern generated (RX) / checked (TX) in place of IIO (SDR_USB_GADGET_TEST_PATTERN_*) */
+	uint32_t test_pattern;
+
+	/* Test pattern rate (RX, samples per second, zero for unpaced) */
+	uint32_t test_rate;
+
+	/* Loopback mode (TX, SDR_USB_GADGET_LOOPBACK_*) */
+	uint32_t loopback;
+
+	/* Enable AD9361 digital loopback while streaming (RX) */
+	bool digital_loopback;
+
+} STREAM_CONFIG_Params_t;
+
+/* Parse legacy START request, queue depth defaulting as provided (depending on bus speed) */
+bool STREAM_CONFIG_ParseStart(const void *data, size_t length, uint32_t default_queue_depth, STREAM_CONFIG_Params_t *params);
+
+/* Parse START_TLV request, queue depth defaulting as provided (depending on bus speed) */
+bool STREAM_CONFIG_ParseTLV(const void *data, size_t length, uint32_t default_queue_depth, STREAM_CONFIG_Params_t *params);
+
+/* Check parsed request is applicable to target stream */
+bool STREAM_CONFIG_CheckTarget(const STREAM_CONFIG_Params_t *params, bool tx);
+
+/* Number of samples occupied by a timestamp, for a given sample size (in bytes) */
+uint32_t STREAM_CONFIG_TimestampSamples(size_t sample_size);
+
+/* Populate capabilities */
+void STREAM_CONFIG_GetCapabilities(cmd_usb_capabilities_response_t *caps);
+
+#endif
@@ -0,0 +1,176 @@
+/* Public header */
+#include "test_pattern.h"
+
+/* Standard / system libraries */
+#include <string.h>
+
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
+/* Macros */
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Definitions */
+#define PRBS_SEED (0x7fffffff)
+#define PRBS_MASK (0x7fffffff)
+#define TONE_QUADRATURE (4) /* Table entries between cosine and sine */
+
+/* Private functions */
+static uint16_t next_word(TEST_PATTERN_Ctx_t *ctx);
+static size_t resync(TEST_PATTERN_Ctx_t *ctx, const uint16_t *src, size_t words);
+
+/* Private variables - one period of cosine, amplitude 2047 (full scale 12-bit) */
+static const int16_t tone_table[] =
+{
+	2047, 1891, 1447, 783, 0, -783, -1447, -1891, -2047, -1891, -1447, -783, 0, 783, 1447, 1891
+};
+
+/* Public functions */
+void TEST_PATTERN_Init(TEST_PATTERN_Ctx_t *ctx, uint32_t pattern, uint32_t num_channels)
+{
+	memset(ctx, 0x00, sizeof(*ctx));
+	ctx->pattern = pattern;
+	ctx->num_channels = num_channels;
+	ctx->prbs = PRBS_SEED;
+}
+
+void TEST_PATTERN_Fill(TEST_PATTERN_Ctx_t *ctx, uint16_t *dest, size_t words)
+{
+	for (size_t i = 0; i < words; i++)
+	{
+		dest[i] = next_word(ctx);
+	}
+}
+
+void TEST_PATTERN_Skip(TEST_PATTERN_Ctx_t *ctx, size_t words)
+{
+	switch (ctx->pattern)
+	{
+		case SDR_USB_GADGET_TEST_PATTERN_COUNTER:
+		{
+			ctx->counter += (uint16_t)words;
+			break;
+		}
+		case SDR_USB_GADGET_TEST_PATTERN_TONE:
+		{
+			size_t channels = ctx->channel + words;
+			ctx->phase = (ctx->phase + (channels / ctx->num_channels)) % ARRAY_SIZE(tone_table);
+			ctx->channel = channels % ctx->num_channels;
+			break;
+		}
+		default:
+		{
+			/* PRBS has no shortcut, step register */
+			for (size_t i = 0; i < words; i++)
+			{
+				next_word(ctx);
+			}
+			break;
+		}
+	}
+}
+
+size_t TEST_PATTERN_Check(TEST_PATTERN_Ctx_t *ctx, const uint16_t *src, size_t words, bool *gap)
+{
+	*gap = false;
+	if ((0 == words) || (SDR_USB_GADGET_TEST_PATTERN_TONE == ctx->pattern))
+	{
+		TEST_PATTERN_Skip(ctx, words);
+		return 0;
+	}
+
+	/* A first word which doesn't follow is either corrupt (the second following) or the pattern having jumped */
+	size_t start = 1;
+	size_t errors = 0;
+	if (next_word(ctx) != src[0])
+	{
+		TEST_PATTERN_Ctx_t ahead = *ctx;
+		if ((words > 1) && (next_word(&ahead) == src[1]))
+		{
+			errors++;
+		}
+		else
+		{
+			start = resync(ctx, src, words);
+			*gap = true;
+		}
+	}
+
+	/* Compare remainder */
+	for (size_t i = start; i < words; i++)
+	{
+		if (next_word(ctx) != src[i])
+		{
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/* Private functions */
+static uint16_t next_word(TEST_PATTERN_Ctx_t *ctx)
+{
+	uint16_t word = 0;
+
+	switch (ctx->pattern)
+	{
+		case SDR_USB_GADGET_TEST_PATTERN_COUNTER:
+		{
+			word = ctx->counter++;
+			break;
+		}
+		case SDR_USB_GADGET_TEST_PATTERN_PRBS:
+		{
+			/*
+			** Register holds the last 31 bits, oldest in bit 0. Each new bit is the XOR of those generated 31 and 28 bits
+			** earlier (x^31 + x^28 + 1), both at least 16 bits back, so a whole word is generated at once (LSB first).
+			*/
+			word = (uint16_t)(ctx->prbs ^ (ctx->prbs >> 3));
+			ctx->prbs = ((ctx->prbs >> 16) | ((uint32_t)word << 15)) & PRBS_MASK;
+			break;
+		}
+		case SDR_USB_GADGET_TEST_PATTERN_TONE:
+		{
+			/* I (even channels) leads Q (odd channels) by a quarter period */
+			uint32_t index = ctx->phase;
+			if (ctx->channel & 1)
+			{
+				index = (index + ARRAY_SIZE(tone_table) - TONE_QUADRATURE) % ARRAY_SIZE(tone_table);
+			}
+			word = (uint16_t)tone_table[index];
+
+			/* Advance phase once per sample */
+			if (++ctx->channel >= ctx->num_channels)
+			{
+				ctx->channel = 0;
+				ctx->phase = (ctx->phase + 1) % ARRAY_SIZE(tone_table);
+			}
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+
+	return word;
+}
+
+static size_t resync(TEST_PATTERN_Ctx_t *ctx, const uint16_t *src, size_t words)
+{
+	/* Counter continues from first word */
+	if (SDR_USB_GADGET_TEST_PATTERN_COUNTER == ctx->pattern)
+	{
+		ctx->counter = src[0] + 1;
+		return 1;
+	}
+
+	/* PRBS register is loaded with the last 31 of the first two words' bits */
+	if (words < 2)
+		return words;
+
+	ctx->prbs = ((src[0] | ((uint32_t)src[1] << 16)) >> 1) & PRBS_MASK;
+
+	return 2;
+}
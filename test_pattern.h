@@ -0,0 +1,45 @@
+#ifndef __TEST_PATTERN_H__
+#define __TEST_PATTERN_H__
+
+/* Standard libraries */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Type definitions - pattern generator context, the pattern continuing across calls */
+typedef struct
+{
+	/* Pattern (SDR_USB_GADGET_TEST_PATTERN_*) */
+	uint32_t pattern;
+
+	/* Number of channels per sample (tone) */
+	uint32_t num_channels;
+
+	/* Counter value of next word */
+	uint16_t counter;
+
+	/* PRBS register, holding the last 31 bits generated */
+	uint32_t prbs;
+
+	/* Channel / phase of next word (tone) */
+	uint32_t channel;
+	uint32_t phase;
+
+} TEST_PATTERN_Ctx_t;
+
+/* Public functions - init generator at start of pattern */
+void TEST_PATTERN_Init(TEST_PATTERN_Ctx_t *ctx, uint32_t pattern, uint32_t num_channels);
+
+/* Generate next words of pattern */
+void TEST_PATTERN_Fill(TEST_PATTERN_Ctx_t *ctx, uint16_t *dest, size_t words);
+
+/* Advance pattern without generating (for buffers dropped on overflow) */
+void TEST_PATTERN_Skip(TEST_PATTERN_Ctx_t *ctx, size_t words);
+
+/*
+** Check next words against pattern, returning the number which differ. Should the words not continue the pattern
+** (counter / PRBS), the generator is resynchronised to them and *gap set. Tone isn't checked, only skipped.
+*/
+size_t TEST_PATTERN_Check(TEST_PATTERN_Ctx_t *ctx, const uint16_t *src, size_t words, bool *gap);
+
+#endif
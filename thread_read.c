@@ -26,7 +26,12 @@
 /* Local modules */
 #include "usb_buff.h"
 #include "ring_buffer.h"
+#include "device_select.h"
 #include "epoll_loop.h"
+#include "stream_config.h"
+#include "sample_format.h"
+#include "test_pattern.h"
+#include "probes.h"
 #include "utils.h"
 
 /* Set the following to periodically report statistics */
@@ -39,9 +44,6 @@
 #define STATS_PERIOD_SECS (5)
 #endif
 
-/* Define number of write buffers to queue up */
-#define NUM_BUFS (16)
-
 /* Macros */
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define DEBUG_PRINT(...) if (debug) printf("Read: "__VA_ARGS__)
@@ -55,37 +57,81 @@ typedef struct
 	/* Keep running */
 	bool keep_running;
 
+	/* IIO context (NULL when streaming a test pattern) */
+	struct iio_context *iio_ctx;
+
 	/* IIO sample buffer */
 	struct iio_buffer *iio_rx_buffer;
 
+	/* AD9361 with digital loopback enabled (NULL if not enabled) */
+	struct iio_device *iio_phy;
+
+	/* Digital loopback marker found */
+	bool marked;
+
 	/* Size of USB buffer (bytes) */
 	size_t usb_buffer_size;
 
+	/* Size of header prefixing each USB buffer (bytes, zero if neither timestamp nor block scale) */
+	size_t header_size;
+
+	/* Size of timestamp starting the header (bytes, zero if disabled), any block scale sample following it */
+	size_t timestamp_size;
+
+	/* IIO buffer size (samples) */
+	size_t iio_samples;
+
+	/* Size of IIO buffer (bytes, exceeding the USB payload for 8-bit wire formats) */
+	size_t iio_buffer_size;
+
+	/* Number of enabled channels, each a 16-bit word (planar / 8-bit wire formats) */
+	unsigned int num_channels;
+
+	/* Shift narrowing the widest enabled channel's significant bits to 8 (8-bit wire format) */
+	unsigned int int8_shift;
+
 	/* AIO context */
 	io_context_t io_ctx;
 
 	/* AIO completion eventfd */
 	int aio_eventfd;
 
-	/* List of buffers */
-	usb_buf_t* buffers[NUM_BUFS];
+	/* List of buffers (queue_depth in use) */
+	usb_buf_t* buffers[STREAM_CONFIG_MAX_QUEUE_DEPTH];
+	unsigned int num_buffers;
 
 	/* Ring buffer of unused AIO requests */
 	RING_BUFFER_Ctx_t ring_buf_ctx;
-	usb_buf_t* ring_buf_data[NUM_BUFS];
+	usb_buf_t* ring_buf_data[STREAM_CONFIG_MAX_QUEUE_DEPTH];
+
+	/* Sequence number of next IIO buffer */
+	uint32_t sequence;
+
+	/* Samples refilled since start (including those dropped on overflow) */
+	uint64_t sample_count;
+
+	/* Test pattern generator, and its pacing timer (-1 if unpaced) */
+	TEST_PATTERN_Ctx_t pattern;
+	int pattern_timerfd;
+
+	/* Generating test pattern whenever a USB transfer is free */
+	bool unpaced;
 
 	#if GENERATE_STATS
 	/* Stats reporting timer */
 	int stats_timerfd;
 
-	/* Overflow count */
-	uint32_t overflows;
+	/* Overflow count at last report */
+	uint64_t last_overflows;
 
-	/* Read period timer */
-	UTILS_TimeStats_t read_period;
+	/* Read period histogram */
+	UTILS_Histogram_t read_period;
 
-	/* Read duration timer */
-	UTILS_TimeStats_t read_dur;
+	/* Refill duration histogram */
+	UTILS_Histogram_t read_dur;
+
+	/* AIO submit to complete latency histogram */
+	UTILS_Histogram_t aio_latency;
 	#endif
 
 } state_t;
@@ -95,11 +141,24 @@ typedef int (*epoll_event_handler)(state_t *state);
 
 /* Global variables */
 extern bool debug;
+extern bool cumulative_stats;
 
 /* Private functions */
+static bool run_thread(THREAD_READ_Args_t *thread_args);
+static bool setup_iio(state_t *state, int epoll_fd, size_t *sample_size);
+static bool setup_pattern(state_t *state, int epoll_fd, size_t *sample_size);
+static bool reserve_header(state_t *state, size_t sample_size);
+static size_t wire_sample_size(uint32_t wire_format, size_t sample_size);
 static int handle_eventfd_thread(state_t *state);
 static int handle_eventfd_aio(state_t *state);
 static int handle_iio_buffer(state_t *state);
+static int handle_pattern_timer(state_t *state);
+static int produce_pattern_buffer(state_t *state);
+static int produce_pattern_buffers(state_t *state);
+static usb_buf_t *take_buffer(state_t *state, uint32_t sequence, uint64_t sample);
+static void mark_first_sample(state_t *state, const uint8_t *data, size_t size, uint64_t sample);
+static void copy_samples(state_t *state, usb_buf_t *buf);
+static int submit_buffer(state_t *state, usb_buf_t *buf);
 #if GENERATE_STATS
 static int handle_stats_timer(state_t *state);
 #endif
@@ -110,6 +169,27 @@ void *THREAD_READ_Entrypoint(void *args)
 {
 	THREAD_READ_Args_t *thread_args = (THREAD_READ_Args_t*)args;
 
+	/* Run thread, publishing its state such that failures are visible to the host */
+	METRICS_SetState(thread_args->metrics, SDR_USB_GADGET_STREAM_STATE_STARTING);
+	bool ok = run_thread(thread_args);
+	METRICS_SetState(thread_args->metrics, ok ? SDR_USB_GADGET_STREAM_STATE_STOPPED : SDR_USB_GADGET_STREAM_STATE_ERROR);
+
+	/* Notify host of stop / failure */
+	NOTIFY_Post(thread_args->notify, ok ? SDR_USB_GADGET_EVENT_STREAM_STOPPED : SDR_USB_GADGET_EVENT_STREAM_ERROR, 0);
+
+	/* Signal main thread that we're exiting, such that it can join with us without blocking */
+	uint64_t eventfd_val = 0x1;
+	if (write(thread_args->done_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
+	{
+		perror("Failed to write thread done eventfd");
+	}
+
+	return NULL;
+}
+
+/* Private functions */
+static bool run_thread(THREAD_READ_Args_t *thread_args)
+{
 	/* Enter */
 	DEBUG_PRINT("Read thread enter\n");
 
@@ -124,13 +204,22 @@ void *THREAD_READ_Entrypoint(void *args)
 
 	/* Store args */
 	state.thread_args = thread_args;
+	state.aio_eventfd = -1;
+	state.pattern_timerfd = -1;
+	#if GENERATE_STATS
+	state.stats_timerfd = -1;
+	#endif
+	METRICS_SetMarker(thread_args->metrics, 0, 0);
+
+	/* Failures below release whatever has been setup so far, as the stream may be restarted */
+	bool ok = false;
 
 	/* Create epoll instance */
 	int epoll_fd = epoll_create1(0);
 	if (epoll_fd < 0)
 	{
 		perror("Failed to create epoll instance");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -145,97 +234,70 @@ void *THREAD_READ_Entrypoint(void *args)
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, thread_args->quit_event_fd, &epoll_event) < 0)
 	{
 		perror("Failed to register thread quit eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
 		DEBUG_PRINT("Registered thread quit eventfd with with epoll :-)\n");
 	}
 
-	/* Create IIO context */
-	struct iio_context *iio_ctx = iio_create_local_context();
-	if (!iio_ctx)
+	/* Setup sample source, IIO device or test pattern generator */
+	size_t sample_size;
+	if (SDR_USB_GADGET_TEST_PATTERN_NONE == thread_args->config.test_pattern)
 	{
-		fprintf(stderr, "Failed to open iio\n");
-		return NULL;
-	}
-
-	/* Retrieve RX streaming device */
-	struct iio_device *iio_dev_rx = iio_context_find_device(iio_ctx, "cf-ad9361-lpc");
-	if (!iio_dev_rx)
-	{
-		fprintf(stderr, "Failed to open iio rx dev\n");
-		return NULL;
+		if (!setup_iio(&state, epoll_fd, &sample_size))
+			goto cleanup;
 	}
-
-	/* Disable all channels */
-	unsigned int nb_channels = iio_device_get_channels_count(iio_dev_rx);
-	for (unsigned int i = 0; i < nb_channels; i++)
+	else
 	{
-		iio_channel_disable(iio_device_get_channel(iio_dev_rx, i));
+		if (!setup_pattern(&state, epoll_fd, &sample_size))
+			goto cleanup;
 	}
 
-	/* Enable required channels */
-	for (unsigned int i = 0; i < 32; i++)
-	{
-		/* Enable channel if required */
-		if (thread_args->iio_channels & (1U << i))
-		{
-			/* Retrieve channel */
-			struct iio_channel *channel = iio_device_get_channel(iio_dev_rx, i);
-			if (!channel)
-			{
-				fprintf(stderr, "Failed to find iio rx chan %u\n", i);
-				return false;
-			}
-
-			/* Enable channels */
-			iio_channel_enable(channel);
-		}
-	}
-
-	/* Create non-cyclic buffer */
-	state.iio_rx_buffer = iio_device_create_buffer(iio_dev_rx, thread_args->iio_buffer_size, false);
-	if (!state.iio_rx_buffer)
+	/* Calculate USB buffer size */
+	state.usb_buffer_size = state.header_size + (sample_size * state.iio_samples);
+	if (state.usb_buffer_size > STREAM_CONFIG_MAX_USB_BUFFER_SIZE)
 	{
-		fprintf(stderr, "Failed to create rx buffer for %zu samples\n", thread_args->iio_buffer_size);
-		return NULL;
+		fprintf(stderr, "USB buffer size %zu exceeds maximum of %u bytes\n", state.usb_buffer_size, STREAM_CONFIG_MAX_USB_BUFFER_SIZE);
+		goto cleanup;
 	}
-
-	/* Register buffer with epoll */
-	epoll_event.events = EPOLLIN;
-	epoll_event.data.ptr = handle_iio_buffer;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, iio_buffer_get_poll_fd(state.iio_rx_buffer), &epoll_event) < 0)
+	if (thread_args->isochronous && (0 != (state.usb_buffer_size % thread_args->max_packet_size)))
 	{
-		/* Failed to register IIO buffer with epoll */
-		perror("Failed to register IIO buffer with epoll");
-		return NULL;
+		/* Transfers must span whole service intervals, such that each buffer occupies a fixed number of (micro)frames */
+		fprintf(stderr, "RX usb buffer size %zu not a multiple of isochronous bytes per interval (%u)\n", state.usb_buffer_size, thread_args->max_packet_size);
+		goto cleanup;
 	}
-	else
+	else if ((thread_args->max_packet_size > 0) && (0 != (state.usb_buffer_size % thread_args->max_packet_size)))
 	{
-		DEBUG_PRINT("Registered IIO buffer with with epoll :-)\n");
+		/* Each transfer ends with a short packet, host reads must be one buffer at a time */
+		DEBUG_PRINT("RX usb buffer size not a multiple of max packet size (%u), host must read whole buffers\n", thread_args->max_packet_size);
 	}
+	state.num_buffers = thread_args->config.queue_depth;
 
-	/* Retrieve number of bytes between two samples of the same channel (aka size of one sample of all enabled channels) */
-	size_t sample_size = iio_buffer_step(state.iio_rx_buffer);
-
-	/* Calculate USB buffer size */
-	state.usb_buffer_size = sample_size * thread_args->iio_buffer_size;
+	/* Publish configuration */
+	METRICS_SetConfig(thread_args->metrics, thread_args->config.enabled_channels, thread_args->config.buffer_size, state.usb_buffer_size, state.num_buffers);
 
 	/* Summarize info */
-	DEBUG_PRINT("RX sample count: %zu, iio sample size: %zu, usb buffer size: %zu\n",
-				thread_args->iio_buffer_size,
+	DEBUG_PRINT("RX sample count: %zu, wire sample size: %zu, header size: %zu, usb buffer size: %zu, queue depth: %u\n",
+				state.iio_samples,
 				sample_size,
-				state.usb_buffer_size);
+				state.header_size,
+				state.usb_buffer_size,
+				state.num_buffers);
+	if (thread_args->isochronous)
+	{
+		uint32_t intervals = state.usb_buffer_size / thread_args->max_packet_size;
+		DEBUG_PRINT("RX isochronous transfer spans %" PRIu32 " intervals, queued data bounded to %" PRIu64 "us\n", intervals, (uint64_t)intervals * state.num_buffers * thread_args->interval_us);
+	}
 
 	/* Reset AIO context */
 	memset(&state.io_ctx, 0x00, sizeof(state.io_ctx));
 
 	/* Setup AIO context */
-	if (io_setup(ARRAY_SIZE(state.buffers), &state.io_ctx) < 0)
+	if (io_setup(state.num_buffers, &state.io_ctx) < 0)
 	{
 		perror("Failed to setup AIO");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -247,7 +309,7 @@ void *THREAD_READ_Entrypoint(void *args)
 	if (state.aio_eventfd < 0)
 	{
 		perror("Failed to open eventfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -261,7 +323,7 @@ void *THREAD_READ_Entrypoint(void *args)
 	{
 		/* Failed to register aio completion eventfd with epoll */
 		perror("Failed to register aio completion eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -269,19 +331,20 @@ void *THREAD_READ_Entrypoint(void *args)
 	}
 
 	/* Init ring buffer */
-	RING_BUFFER_Init(&state.ring_buf_ctx, ARRAY_SIZE(state.ring_buf_data));
+	RING_BUFFER_Init(&state.ring_buf_ctx, state.num_buffers);
 
 	/* Allocate buffers */
-	for (unsigned int i = 0; i < ARRAY_SIZE(state.buffers); i++)
+	for (unsigned int i = 0; i < state.num_buffers; i++)
 	{
 		/* Allocate buffer */
 		usb_buf_t *buf = alloc_usb_buffer(state.usb_buffer_size, thread_args->output_fd, state.aio_eventfd);
 		if (!buf)
 		{
-			return NULL;
+			goto cleanup;
 		}
 
 		/* Store buffer */
+		buf->index = (uint16_t)i;
 		state.buffers[i] = buf;
 
 		/* Push buffer into unused ring position */
@@ -294,7 +357,7 @@ void *THREAD_READ_Entrypoint(void *args)
 	if (state.stats_timerfd < 0)
 	{
 		perror("Failed to open timerfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -308,7 +371,7 @@ void *THREAD_READ_Entrypoint(void *args)
 	if (timerfd_settime(state.stats_timerfd, 0, &timer_period, NULL) < 0)
 	{
 		perror("Failed to set timerfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -322,7 +385,7 @@ void *THREAD_READ_Entrypoint(void *args)
 	{
 		/* Failed to register timer with epoll */
 		perror("Failed to register timer eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -330,13 +393,35 @@ void *THREAD_READ_Entrypoint(void *args)
 	}
 
 	/* Init timer */
-	UTILS_ResetTimeStats(&state.read_period);
-	UTILS_ResetTimeStats(&state.read_dur);
+	UTILS_ResetHistogram(&state.read_period);
+	UTILS_ResetHistogram(&state.read_dur);
+	UTILS_ResetHistogram(&state.aio_latency);
+	state.last_overflows = METRICS_Read(&thread_args->metrics->overflows);
 	#endif
 
+	/* Loop DAC back to ADC if requested, as the last step such that it's only left enabled while streaming (disabled again on exit) */
+	if (thread_args->config.digital_loopback)
+	{
+		struct iio_device *phy = iio_context_find_device(state.iio_ctx, DEVICE_SELECT_PHY);
+		if (!phy || (iio_device_debug_attr_write(phy, "loopback", "1") < 0))
+		{
+			fprintf(stderr, "Failed to enable digital loopback on %s\n", DEVICE_SELECT_PHY);
+			goto cleanup;
+		}
+		state.iio_phy = phy;
+		DEBUG_PRINT("Enabled digital loopback :-)\n");
+	}
+
 	/* Enter main loop */
 	DEBUG_PRINT("Enter read loop..\n");
 	state.keep_running = true;
+	METRICS_SetState(thread_args->metrics, SDR_USB_GADGET_STREAM_STATE_RUNNING);
+	NOTIFY_Post(thread_args->notify, SDR_USB_GADGET_EVENT_STREAM_STARTED, 0);
+	if (state.unpaced && (produce_pattern_buffers(&state) < 0))
+	{
+		/* Failed to queue initial buffers */
+		goto cleanup;
+	}
 	while (state.keep_running)
 	{
 		if (EPOLL_LOOP_Run(epoll_fd, 30000, &state) < 0)
@@ -346,9 +431,14 @@ void *THREAD_READ_Entrypoint(void *args)
 		}
 	}
 	DEBUG_PRINT("Exit read loop..\n");
+	ok = !state.keep_running;
 
+cleanup:
 	/* Destroy IO context (cancelling any pending transfers) */
-	io_destroy(state.io_ctx);
+	if (state.io_ctx)
+	{
+		io_destroy(state.io_ctx);
+	}
 
 	/* Free buffers after destroying context now kernel won't be using them */
 	for (unsigned int i = 0; i < ARRAY_SIZE(state.buffers); i++)
@@ -360,20 +450,247 @@ void *THREAD_READ_Entrypoint(void *args)
 
 	/* Close / destroy everything */
 	#if GENERATE_STATS
-	close(state.stats_timerfd);
+	if (state.stats_timerfd >= 0)
+	{
+		close(state.stats_timerfd);
+	}
 	#endif
-	close(state.aio_eventfd);
-	iio_buffer_destroy(state.iio_rx_buffer);
-	iio_context_destroy(iio_ctx);
-	close(epoll_fd);
+	if (state.aio_eventfd >= 0)
+	{
+		close(state.aio_eventfd);
+	}
+	if (state.pattern_timerfd >= 0)
+	{
+		close(state.pattern_timerfd);
+	}
+	if (state.iio_rx_buffer)
+	{
+		iio_buffer_destroy(state.iio_rx_buffer);
+	}
+	if (state.iio_phy && (iio_device_debug_attr_write(state.iio_phy, "loopback", "0") < 0))
+	{
+		fprintf(stderr, "Failed to disable digital loopback\n");
+	}
+	if (state.iio_ctx)
+	{
+		iio_context_destroy(state.iio_ctx);
+	}
+	if (epoll_fd >= 0)
+	{
+		close(epoll_fd);
+	}
 
 	/* Exit */
 	DEBUG_PRINT("Read thread exit\n");
 
-	return NULL;
+	return ok;
+}
+
+static bool setup_iio(state_t *state, int epoll_fd, size_t *sample_size)
+{
+	THREAD_READ_Args_t *thread_args = state->thread_args;
+
+	/* Create IIO context */
+	state->iio_ctx = iio_create_local_context();
+	if (!state->iio_ctx)
+	{
+		fprintf(stderr, "Failed to open iio\n");
+		return false;
+	}
+
+	/* Retrieve RX streaming device, as requested or the default */
+	const char *device = thread_args->config.device[0] ? thread_args->config.device : thread_args->default_device;
+	struct iio_device *iio_dev_rx = DEVICE_SELECT_Find(state->iio_ctx, device, false);
+	if (!iio_dev_rx)
+	{
+		fprintf(stderr, "Failed to open iio rx dev: %s\n", device);
+		return false;
+	}
+	DEBUG_PRINT("Using iio rx dev: %s\n", iio_device_get_name(iio_dev_rx));
+
+	/* Disable all channels */
+	unsigned int nb_channels = iio_device_get_channels_count(iio_dev_rx);
+	for (unsigned int i = 0; i < nb_channels; i++)
+	{
+		iio_channel_disable(iio_device_get_channel(iio_dev_rx, i));
+	}
+
+	/* Enable required channels */
+	for (unsigned int i = 0; i < 32; i++)
+	{
+		/* Enable channel if required */
+		if (thread_args->config.enabled_channels & (1U << i))
+		{
+			/* Retrieve channel */
+			struct iio_channel *channel = iio_device_get_channel(iio_dev_rx, i);
+			if (!channel)
+			{
+				fprintf(stderr, "Failed to find iio rx chan %u\n", i);
+				return false;
+			}
+
+			/* Enable channels */
+			iio_channel_enable(channel);
+
+			/* Narrow the most significant bits of the widest channel (e.g. 4 for the AD9361's 12-bit samples) */
+			const struct iio_data_format *format = iio_channel_get_data_format(channel);
+			if (format && (format->bits > 8) && ((format->bits - 8U) > state->int8_shift))
+			{
+				state->int8_shift = format->bits - 8U;
+			}
+		}
+	}
+
+	/* Reserve space at start of USB buffer for timestamp / block scale if required */
+	state->iio_samples = thread_args->config.buffer_size;
+	if (thread_args->config.timestamps || (SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP == thread_args->config.wire_format))
+	{
+		ssize_t header_sample_size = iio_device_get_sample_size(iio_dev_rx);
+		if (header_sample_size <= 0)
+		{
+			fprintf(stderr, "Failed to retrieve rx sample size\n");
+			return false;
+		}
+		if (!reserve_header(state, wire_sample_size(thread_args->config.wire_format, header_sample_size)))
+			return false;
+	}
+
+	/* Create non-cyclic buffer */
+	state->iio_rx_buffer = iio_device_create_buffer(iio_dev_rx, state->iio_samples, false);
+	if (!state->iio_rx_buffer)
+	{
+		fprintf(stderr, "Failed to create rx buffer for %zu samples\n", state->iio_samples);
+		return false;
+	}
+
+	/* Register buffer with epoll */
+	struct epoll_event epoll_event;
+	epoll_event.events = EPOLLIN;
+	epoll_event.data.ptr = handle_iio_buffer;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, iio_buffer_get_poll_fd(state->iio_rx_buffer), &epoll_event) < 0)
+	{
+		/* Failed to register IIO buffer with epoll */
+		perror("Failed to register IIO buffer with epoll");
+		return false;
+	}
+	else
+	{
+		DEBUG_PRINT("Registered IIO buffer with with epoll :-)\n");
+	}
+
+	/* Retrieve number of bytes between two samples of the same channel (aka size of one sample of all enabled channels) */
+	*sample_size = iio_buffer_step(state->iio_rx_buffer);
+
+	/* Planar / 8-bit layouts are produced by converting 16-bit words */
+	if (SDR_USB_GADGET_WIRE_FORMAT_IIO != thread_args->config.wire_format)
+	{
+		state->num_channels = __builtin_popcount(thread_args->config.enabled_channels);
+		if (*sample_size != (state->num_channels * sizeof(int16_t)))
+		{
+			fprintf(stderr, "Wire format %" PRIu32 " requires 16-bit channels, sample size: %zu\n", thread_args->config.wire_format, *sample_size);
+			return false;
+		}
+	}
+	state->iio_buffer_size = state->iio_samples * (*sample_size);
+	*sample_size = wire_sample_size(thread_args->config.wire_format, *sample_size);
+
+	return true;
+}
+
+static bool setup_pattern(state_t *state, int epoll_fd, size_t *sample_size)
+{
+	THREAD_READ_Args_t *thread_args = state->thread_args;
+
+	/* Samples are a 16-bit word per enabled channel, as the AD9361's */
+	unsigned int num_channels = __builtin_popcount(thread_args->config.enabled_channels);
+	*sample_size = num_channels * sizeof(uint16_t);
+	TEST_PATTERN_Init(&state->pattern, thread_args->config.test_pattern, num_channels);
+	DEBUG_PRINT("Generating test pattern %u at %u samples/s (zero for unpaced)\n", thread_args->config.test_pattern, thread_args->config.test_rate);
+
+	/* Reserve space at start of USB buffer for timestamp if required */
+	state->iio_samples = thread_args->config.buffer_size;
+	if (thread_args->config.timestamps && !reserve_header(state, *sample_size))
+		return false;
+
+	/* Unpaced patterns are generated as USB transfers complete */
+	if (0 == thread_args->config.test_rate)
+	{
+		state->unpaced = true;
+		return true;
+	}
+
+	/* Create pacing timer, expiring once per buffer period */
+	state->pattern_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (state->pattern_timerfd < 0)
+	{
+		perror("Failed to open pattern timerfd");
+		return false;
+	}
+	uint64_t period_ns = ((uint64_t)state->iio_samples * 1000000000) / thread_args->config.test_rate;
+	if (0 == period_ns)
+	{
+		period_ns = 1;
+	}
+	struct itimerspec timer_period =
+	{
+		.it_value = { .tv_sec = period_ns / 1000000000, .tv_nsec = period_ns % 1000000000 },
+		.it_interval = { .tv_sec = period_ns / 1000000000, .tv_nsec = period_ns % 1000000000 }
+	};
+	if (timerfd_settime(state->pattern_timerfd, 0, &timer_period, NULL) < 0)
+	{
+		perror("Failed to set pattern timerfd");
+		return false;
+	}
+
+	/* Register timer with epoll */
+	struct epoll_event epoll_event;
+	epoll_event.events = EPOLLIN;
+	epoll_event.data.ptr = handle_pattern_timer;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state->pattern_timerfd, &epoll_event) < 0)
+	{
+		perror("Failed to register pattern timer with epoll");
+		return false;
+	}
+	else
+	{
+		DEBUG_PRINT("Registered pattern timer with with epoll :-)\n");
+	}
+
+	return true;
+}
+
+static bool reserve_header(state_t *state, size_t sample_size)
+{
+	/* Timestamp, followed by a sample holding the block scale (8-bit block floating point) */
+	uint32_t timestamp_samples = state->thread_args->config.timestamps ? STREAM_CONFIG_TimestampSamples(sample_size) : 0;
+	uint32_t header_samples = timestamp_samples;
+	if (SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP == state->thread_args->config.wire_format)
+	{
+		header_samples++;
+	}
+	if (state->iio_samples <= header_samples)
+	{
+		fprintf(stderr, "RX buffer of %zu samples too small for %" PRIu32 " sample header\n", state->iio_samples, header_samples);
+		return false;
+	}
+	state->iio_samples -= header_samples;
+	state->header_size = header_samples * sample_size;
+	state->timestamp_size = timestamp_samples * sample_size;
+
+	return true;
+}
+
+static size_t wire_sample_size(uint32_t wire_format, size_t sample_size)
+{
+	/* 8-bit formats carry a byte per 16-bit IIO word */
+	if ((SDR_USB_GADGET_WIRE_FORMAT_INT8 == wire_format) || (SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP == wire_format))
+	{
+		return sample_size / 2;
+	}
+
+	return sample_size;
 }
 
-/* Private functions */
 static int handle_eventfd_thread(state_t *state)
 {
 	/* Quit having detected write on eventfd */
@@ -405,23 +722,47 @@ static int handle_eventfd_aio(state_t *state)
 	}
 
 	/* Iterate over events */
+	bool shutdown = false;
 	for (int i = 0; i < ret; i++)
 	{
 		/* Shorthand ptr */
 		struct io_event *event = &events[i];
 
 		/* Check for success */
-		if (state->usb_buffer_size != (size_t)event->res)
+		if (state->usb_buffer_size == (size_t)event->res)
 		{
-			/* Not all data was written, or write failed, check if failure was down to configuration being disabled */
-			if (-ESHUTDOWN != (long)event->res)
-			{
-				fprintf(stderr, "USB write completed with error, res: %ld, res2: %ld\n", event->res, event->res2);
-			}
+			/* Count transfer */
+			METRICS_Add(&state->thread_args->metrics->bytes, state->usb_buffer_size);
+			METRICS_Add(&state->thread_args->metrics->buffers, 1);
+		}
+		else if (-ESHUTDOWN == (long)event->res)
+		{
+			/* Write failed due to configuration being disabled */
+			METRICS_Add(&state->thread_args->metrics->shutdowns, 1);
+			shutdown = true;
+		}
+		else if (state->thread_args->isochronous)
+		{
+			/* Isochronous transfer missed its (micro)frames, report loss without retrying */
+			METRICS_Add(&state->thread_args->metrics->lost, 1);
+			NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_LOSS, state->sample_count);
+		}
+		else
+		{
+			/* Not all data was written, or write failed */
+			fprintf(stderr, "USB write completed with error, res: %ld, res2: %ld\n", event->res, event->res2);
+			METRICS_Add(&state->thread_args->metrics->aio_errors, 1);
 		}
 
 		/* Retrieve buffer */
 		usb_buf_t *buf = (usb_buf_t*)event->data;
+		TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_COMPLETE, buf->index, buf->sequence);
+		PROBE3(rx_complete, buf->index, buf->sequence, (long)event->res);
+
+		#if GENERATE_STATS
+		/* Capture submit to complete latency */
+		UTILS_RecordHistogram(&state->aio_latency, UTILS_GetMonotonicMicros() - buf->submit_time);
+		#endif
 
 		/* Mark as unused */
 		buf->in_use = false;
@@ -430,66 +771,235 @@ static int handle_eventfd_aio(state_t *state)
 		state->ring_buf_data[RING_BUFFER_Put(&state->ring_buf_ctx)] = buf;
 	}
 
+	/* Refill unpaced test pattern, unless the stream is being stopped on disable */
+	if (state->unpaced && !shutdown)
+		return produce_pattern_buffers(state);
+
 	return 0;
 }
 
 static int handle_iio_buffer(state_t *state)
 {
+	PROBE1(rx_buffer_enter, state->sequence);
+
 	#if GENERATE_STATS
 	/* Capture read period */
-	UTILS_UpdateTimeStats(&state->read_period);
+	UTILS_UpdateHistogram(&state->read_period);
 
 	/* Record read start time */
-	UTILS_StartTimeStats(&state->read_dur);
+	UTILS_StartHistogram(&state->read_dur);
 	#endif
 
 	/* Refill buffer */
 	ssize_t nbytes = iio_buffer_refill(state->iio_rx_buffer);
-	if (nbytes != (ssize_t)state->usb_buffer_size)
+	if (nbytes != (ssize_t)state->iio_buffer_size)
 	{
-		fprintf(stderr, "RX buffer read failed, expected %zu, read %zd bytes\n", state->usb_buffer_size, nbytes);
+		fprintf(stderr, "RX buffer read failed, expected %zu, read %zd bytes\n", state->iio_buffer_size, nbytes);
 		return -1;
 	}
 
+	/* Advance sample index, whether or not the buffer is dropped, such that timestamps remain continuous across overflows */
+	uint32_t sequence = state->sequence++;
+	uint64_t sample = state->sample_count;
+	state->sample_count += state->iio_samples;
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_REFILL, TRACE_NO_BUFFER, sequence);
+
+	/* Search for digital loopback marker, once the TX stream has pushed it */
+	if (state->iio_phy && !state->marked && (METRICS_GetMarkerTime(state->thread_args->peer_metrics) > 0))
+	{
+		mark_first_sample(state, iio_buffer_start(state->iio_rx_buffer), state->iio_buffer_size, sample);
+	}
+
 	#if GENERATE_STATS
 	/* Capture read end time */
-	UTILS_UpdateTimeStats(&state->read_dur);
+	UTILS_UpdateHistogram(&state->read_dur);
 
 	/* Record period start time (to subtract read time above) */
-	UTILS_StartTimeStats(&state->read_period);
+	UTILS_StartHistogram(&state->read_period);
 	#endif
 
+	/* Copy data into free buffer, unless overflowing */
+	usb_buf_t *buf = take_buffer(state, sequence, sample);
+	if (buf)
+	{
+		copy_samples(state, buf);
+		TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_COPY, buf->index, sequence);
+		if (submit_buffer(state, buf) < 0)
+			return -1;
+	}
+
+	PROBE1(rx_buffer_exit, sequence);
+
+	return 0;
+}
+
+static int handle_pattern_timer(state_t *state)
+{
+	/* Read timer to acknowledge it */
+	uint64_t expirations;
+	if (read(state->pattern_timerfd, &expirations, sizeof(expirations)) < 0)
+	{
+		perror("Failed to read pattern timerfd");
+		return -1;
+	}
+
+	/* Generate a buffer per period elapsed, those without a free USB transfer overflowing */
+	for (uint64_t i = 0; i < expirations; i++)
+	{
+		if (produce_pattern_buffer(state) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int produce_pattern_buffer(state_t *state)
+{
+	PROBE1(rx_buffer_enter, state->sequence);
+
+	/* Advance sample index as for IIO buffers */
+	uint32_t sequence = state->sequence++;
+	uint64_t sample = state->sample_count;
+	state->sample_count += state->iio_samples;
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_REFILL, TRACE_NO_BUFFER, sequence);
+
+	/* Generate directly into free buffer, the pattern advancing regardless such that overflows are visible */
+	size_t words = (state->usb_buffer_size - state->header_size) / sizeof(uint16_t);
+	usb_buf_t *buf = take_buffer(state, sequence, sample);
+	if (buf)
+	{
+		TEST_PATTERN_Fill(&state->pattern, (uint16_t*)(buf->data + state->header_size), words);
+		TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_COPY, buf->index, sequence);
+		if (submit_buffer(state, buf) < 0)
+			return -1;
+	}
+	else
+	{
+		TEST_PATTERN_Skip(&state->pattern, words);
+	}
+
+	PROBE1(rx_buffer_exit, sequence);
+
+	return 0;
+}
+
+static int produce_pattern_buffers(state_t *state)
+{
+	/* Fill every free buffer */
+	while (state->ring_buf_ctx.usage > 0)
+	{
+		if (produce_pattern_buffer(state) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static usb_buf_t *take_buffer(state_t *state, uint32_t sequence, uint64_t sample)
+{
 	/* Retrieve free buffer */
 	uint32_t index = RING_BUFFER_Get(&state->ring_buf_ctx);
-	if (RING_BUFFER_NO_INDEX != index)
+	if (RING_BUFFER_NO_INDEX == index)
+	{
+		/* Count overflow */
+		METRICS_Add(&state->thread_args->metrics->overflows, 1);
+		PROBE1(rx_overflow, sequence);
+
+		/* Notify host of samples lost */
+		NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_OVERFLOW, sample);
+
+		return NULL;
+	}
+
+	/* Retrieve ptr to buffer */
+	usb_buf_t *buf = state->ring_buf_data[index];
+
+	/* Mark in use */
+	buf->in_use = true;
+	buf->sequence = sequence;
+
+	/* Stamp buffer with index of its first sample, padding to a whole number of samples */
+	if (state->timestamp_size > 0)
 	{
-		/* Retrieve ptr to buffer */
-		usb_buf_t *buf = state->ring_buf_data[index];
+		memcpy(buf->data, &sample, sizeof(sample));
+		memset(buf->data + sizeof(sample), 0x00, state->timestamp_size - sizeof(sample));
+	}
 
-		/* Mark in use */
-		buf->in_use = true;
+	return buf;
+}
 
-		/* Copy data into buffer */
-		memcpy(buf->data, iio_buffer_start(state->iio_rx_buffer), state->usb_buffer_size);
+static void mark_first_sample(state_t *state, const uint8_t *data, size_t size, uint64_t sample)
+{
+	/* Publish index of first non-zero sample received */
+	size_t sample_size = iio_buffer_step(state->iio_rx_buffer);
+	for (size_t offset = 0; offset < size; offset++)
+	{
+		if (data[offset])
+		{
+			METRICS_SetMarker(state->thread_args->metrics, sample + (offset / sample_size), UTILS_GetMonotonicMicros());
+			state->marked = true;
+			DEBUG_PRINT("Digital loopback marker received at sample %" PRIu64 "\n", sample + (offset / sample_size));
+			break;
+		}
+	}
+}
 
-		/* Submit request */
-		struct iocb *iocb = &buf->iocb;
-		int res = io_submit(state->io_ctx, 1, &iocb);
-		if (1 != res)
+static void copy_samples(state_t *state, usb_buf_t *buf)
+{
+	/* Copy IIO buffer into USB buffer (skipping header), converting to wire format in the same pass */
+	const int16_t *src = iio_buffer_start(state->iio_rx_buffer);
+	uint8_t *dest = buf->data + state->header_size;
+	size_t words = state->iio_samples * state->num_channels;
+	switch (state->thread_args->config.wire_format)
+	{
+		case SDR_USB_GADGET_WIRE_FORMAT_PLANAR:
 		{
-			/* Failed to submit context */
-			perror("Failed to submit usb write");
-			buf->in_use = false;
-			return -1;
+			SAMPLE_FORMAT_Deinterleave16((int16_t*)dest, src, state->num_channels, state->iio_samples);
+			break;
+		}
+		case SDR_USB_GADGET_WIRE_FORMAT_INT8:
+		{
+			SAMPLE_FORMAT_Narrow8((int8_t*)dest, src, words, state->int8_shift);
+			break;
+		}
+		case SDR_USB_GADGET_WIRE_FORMAT_INT8_BFP:
+		{
+			/* Scale occupies the sample following any timestamp, host multiplies by 2^shift */
+			unsigned int shift = SAMPLE_FORMAT_BlockShift8(src, words);
+			uint8_t *scale = buf->data + state->timestamp_size;
+			memset(scale, 0x00, state->header_size - state->timestamp_size);
+			scale[0] = shift;
+			SAMPLE_FORMAT_Narrow8((int8_t*)dest, src, words, shift);
+			break;
+		}
+		default:
+		{
+			memcpy(dest, src, state->iio_buffer_size);
+			break;
 		}
 	}
-	else
+}
+
+static int submit_buffer(state_t *state, usb_buf_t *buf)
+{
+	#if GENERATE_STATS
+	/* Record submit time */
+	buf->submit_time = UTILS_GetMonotonicMicros();
+	#endif
+
+	/* Submit request */
+	struct iocb *iocb = &buf->iocb;
+	int res = io_submit(state->io_ctx, 1, &iocb);
+	if (1 != res)
 	{
-		#if GENERATE_STATS
-		/* Count overflow */
-		state->overflows++;
-		#endif
+		/* Failed to submit context */
+		perror("Failed to submit usb write");
+		METRICS_Add(&state->thread_args->metrics->aio_errors, 1);
+		buf->in_use = false;
+		return -1;
 	}
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_RX_SUBMIT, buf->index, buf->sequence);
+	PROBE2(rx_submit, buf->index, buf->sequence);
 
 	return 0;
 }
@@ -505,30 +1015,26 @@ static int handle_stats_timer(state_t *state)
 		return 1;
 	}
 
-	/* Report min/max/average read period */
-	printf("Read period: min: %"PRIu64", max: %"PRIu64", avg: %"PRIu64" (uS)\n",
-		   state->read_period.min,
-		   state->read_period.max,
-		   UTILS_CalcAverageTimeStats(&state->read_period)
-	);
-
-	/* Report min/max/average read duration */
-	printf("Read dur: min: %"PRIu64", max: %"PRIu64", avg: %"PRIu64" (uS)\n",
-		   state->read_dur.min,
-		   state->read_dur.max,
-		   UTILS_CalcAverageTimeStats(&state->read_dur)
-	);
+	/* Report read period, refill duration and AIO latency distributions */
+	UTILS_PrintHistogram("Read period", &state->read_period);
+	UTILS_PrintHistogram("Refill dur", &state->read_dur);
+	UTILS_PrintHistogram("USB write AIO latency", &state->aio_latency);
 
 	/* Check for overflows */
-	if (state->overflows > 0)
+	uint64_t overflows = METRICS_Read(&state->thread_args->metrics->overflows);
+	if (overflows != state->last_overflows)
 	{
-		printf("Read overflows: %u in last 5s period\n", state->overflows);
+		printf("Read overflows: %"PRIu64" in last %us period\n", overflows - state->last_overflows, STATS_PERIOD_SECS);
 	}
 
-	/* Reset stats */
-	UTILS_ResetTimeStats(&state->read_period);
-	UTILS_ResetTimeStats(&state->read_dur);
-	state->overflows = 0;
+	/* Reset stats, unless cumulative view requested */
+	if (!cumulative_stats)
+	{
+		UTILS_ResetHistogram(&state->read_period);
+		UTILS_ResetHistogram(&state->read_dur);
+		UTILS_ResetHistogram(&state->aio_latency);
+	}
+	state->last_overflows = overflows;
 
 	return 0;
 }
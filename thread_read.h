@@ -5,20 +5,50 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/* Local modules */
+#include "metrics.h"
+#include "notify.h"
+#include "stream_config.h"
+#include "trace.h"
+
 /* Type definitions - thread args */
 typedef struct
 {
 	/* Eventfd used to signal thread to quit */
 	int quit_event_fd;
 
+	/* Eventfd written by thread as it exits */
+	int done_event_fd;
+
 	/* USB endpoint to write to */
 	int output_fd;
 
-	/* Enabled channels */
-	uint32_t iio_channels;
+	/* Stream configuration */
+	STREAM_CONFIG_Params_t config;
+
+	/* IIO device used when the configuration doesn't name one (name / id, or DEVICE_SELECT_AUTO) */
+	const char *default_device;
+
+	/* Endpoint max packet size at negotiated speed (in bytes, per (micro)frame if isochronous) */
+	uint32_t max_packet_size;
+
+	/* Endpoint is isochronous, failed transfers being reported as lost rather than errors */
+	bool isochronous;
+
+	/* Isochronous service interval (microseconds, each carrying max_packet_size bytes) */
+	uint32_t interval_us;
+
+	/* Runtime counters */
+	METRICS_Thread_t *metrics;
+
+	/* Counters of the interface's TX stream, publishing the digital loopback marker */
+	const METRICS_Thread_t *peer_metrics;
+
+	/* Buffer lifecycle trace (NULL if disabled) */
+	TRACE_Ring_t *trace;
 
-	/* Sample buffer size (in samples) */
-	size_t iio_buffer_size;
+	/* Host event notifications */
+	NOTIFY_Source_t *notify;
 
 } THREAD_READ_Args_t;
 
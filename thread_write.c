@@ -25,7 +25,14 @@
 
 /* Local modules */
 #include "usb_buff.h"
+#include "ring_buffer.h"
+#include "device_select.h"
 #include "epoll_loop.h"
+#include "stream_config.h"
+#include "sample_format.h"
+#include "test_pattern.h"
+#include "probes.h"
+#include "time_queue.h"
 #include "utils.h"
 
 /* Set the following to periodically report statistics */
@@ -38,8 +45,8 @@
 #define STATS_PERIOD_SECS (5)
 #endif
 
-/* Define number of read buffers to queue up */
-#define NUM_BUFS (16)
+/* Number of kernel buffers used by libiio by default */
+#define DEFAULT_KERNEL_BUFFERS (4)
 
 /* Macros */
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -54,33 +61,92 @@ typedef struct
 	/* Keep running */
 	bool keep_running;
 
-	/* IIO sample buffer */
+	/* IIO context / device / sample buffer (NULL when checking a test pattern) */
+	struct iio_context *iio_ctx;
+	struct iio_device *iio_dev_tx;
 	struct iio_buffer *iio_tx_buffer;
 
 	/* Size of USB buffer (bytes) */
 	size_t usb_buffer_size;
 
+	/* Size of timestamp prefixing each USB buffer (bytes, zero if disabled) */
+	size_t header_size;
+
+	/* Size of one sample of all enabled channels (bytes) */
+	size_t sample_size;
+
+	/* IIO buffer size (samples) */
+	size_t iio_samples;
+
+	/* Number of enabled channels, each a 16-bit word (planar wire format) */
+	unsigned int num_channels;
+
 	/* AIO context */
 	io_context_t io_ctx;
 
 	/* AIO completion eventfd */
 	int aio_eventfd;
 
-	/* List of buffers */
-	usb_buf_t* buffers[NUM_BUFS];
+	/* List of buffers (queue_depth queued for reading, plus one being reassembled) */
+	usb_buf_t* buffers[STREAM_CONFIG_MAX_QUEUE_DEPTH + 1];
+	unsigned int num_buffers;
+
+	/* Buffer being reassembled from short transfers, and bytes held */
+	usb_buf_t *assembly;
+	size_t assembly_fill;
+
+	/* Sequence number of next USB buffer */
+	uint32_t sequence;
+
+	/* Samples pushed since start */
+	uint64_t sample_count;
+
+	/* First non-zero sample pushed, published as digital loopback marker */
+	bool marked;
+
+	/* Underrun watchdog timer (-1 if disabled), restarted on each push to fire once the IIO kernel buffers should have drained */
+	int watchdog_timerfd;
+	uint64_t watchdog_period_ns;
+	uint64_t drain_time_ns;
+	unsigned int kernel_buffers;
+
+	/* Data pushed on underrun, last buffer (repeat) or sample (hold) pushed */
+	uint8_t *fill_data;
+
+	/* Accumulating buffers before pushing (prefill) */
+	bool priming;
+
+	/* Buffers accumulated while priming */
+	RING_BUFFER_Ctx_t prefill_ctx;
+	usb_buf_t* prefill_data[STREAM_CONFIG_MAX_QUEUE_DEPTH];
+
+	/* Buffers awaiting their timestamp (timed TX) */
+	TIME_QUEUE_Ctx_t schedule;
+	TIME_QUEUE_Entry_t schedule_data[STREAM_CONFIG_MAX_QUEUE_DEPTH];
+
+	/* Test pattern checker */
+	TEST_PATTERN_Ctx_t pattern;
+
+	/* Buffers looped back transfers are copied into (copy loopback), and ring of those unused */
+	usb_buf_t* loopback_buffers[STREAM_CONFIG_MAX_QUEUE_DEPTH];
+	RING_BUFFER_Ctx_t loopback_ctx;
+	usb_buf_t* loopback_data[STREAM_CONFIG_MAX_QUEUE_DEPTH];
 
 	#if GENERATE_STATS
 	/* Stats reporting timer */
 	int stats_timerfd;
 
-	/* Overflow count */
-	uint32_t overflows;
+	/* Underrun count at last report */
+	uint64_t last_underruns;
 
-	/* Write period timer */
-	UTILS_TimeStats_t write_period;
+	/* Write period histogram */
+	UTILS_Histogram_t write_period;
 
-	/* Write duration timer */
-	UTILS_TimeStats_t write_dur;
+	/* Push duration histogram */
+	UTILS_Histogram_t write_dur;
+
+	/* AIO submit to complete latency histogram */
+	UTILS_Histogram_t aio_latency;
 	#endif
 
 } state_t;
@@ -90,13 +156,30 @@ typedef int (*epoll_event_handler)(state_t *state);
 
 /* Global variables */
 extern bool debug;
+extern bool cumulative_stats;
 
 /* Private functions */
+static bool run_thread(THREAD_WRITE_Args_t *thread_args);
+static bool setup_iio(state_t *state, int epoll_fd, size_t *sample_size);
+static bool setup_bypass(state_t *state, size_t *sample_size);
+static bool reserve_header(state_t *state, size_t sample_size);
 static int handle_eventfd_thread(state_t *state);
 static int handle_eventfd_aio(state_t *state);
+static int handle_iio_buffer(state_t *state);
+static int handle_watchdog_timer(state_t *state);
+static void restart_watchdog(state_t *state);
 #if GENERATE_STATS
 static int handle_stats_timer(state_t *state);
 #endif
+static usb_buf_t *reassemble(state_t *state, usb_buf_t *buf, size_t length);
+static void push_buffer(state_t *state, usb_buf_t *buf);
+static void push_zeros(state_t *state, size_t count);
+static void mark_first_sample(state_t *state, const uint16_t *data, size_t words);
+static void check_pattern(state_t *state, usb_buf_t *buf);
+static int loop_back(state_t *state, usb_buf_t *buf, size_t length);
+static int handle_loopback_complete(state_t *state, usb_buf_t *buf, const struct io_event *event);
+static bool load_waveform(state_t *state, usb_buf_t *buf);
+static int submit_usb_buffer(state_t *state, usb_buf_t *buf);
 static usb_buf_t *alloc_usb_buffer(size_t size, int usb_fd, int event_fd);
 
 /* Public functions */
@@ -104,6 +187,27 @@ void *THREAD_WRITE_Entrypoint(void *args)
 {
 	THREAD_WRITE_Args_t *thread_args = (THREAD_WRITE_Args_t*)args;
 
+	/* Run thread, publishing its state such that failures are visible to the host */
+	METRICS_SetState(thread_args->metrics, SDR_USB_GADGET_STREAM_STATE_STARTING);
+	bool ok = run_thread(thread_args);
+	METRICS_SetState(thread_args->metrics, ok ? SDR_USB_GADGET_STREAM_STATE_STOPPED : SDR_USB_GADGET_STREAM_STATE_ERROR);
+
+	/* Notify host of stop / failure */
+	NOTIFY_Post(thread_args->notify, ok ? SDR_USB_GADGET_EVENT_STREAM_STOPPED : SDR_USB_GADGET_EVENT_STREAM_ERROR, 0);
+
+	/* Signal main thread that we're exiting, such that it can join with us without blocking */
+	uint64_t eventfd_val = 0x1;
+	if (write(thread_args->done_event_fd, &eventfd_val, sizeof(eventfd_val)) < 0)
+	{
+		perror("Failed to write thread done eventfd");
+	}
+
+	return NULL;
+}
+
+/* Private functions */
+static bool run_thread(THREAD_WRITE_Args_t *thread_args)
+{
 	/* Enter */
 	DEBUG_PRINT("Write thread enter\n");
 
@@ -118,13 +222,22 @@ void *THREAD_WRITE_Entrypoint(void *args)
 
 	/* Store args */
 	state.thread_args = thread_args;
+	state.aio_eventfd = -1;
+	state.watchdog_timerfd = -1;
+	#if GENERATE_STATS
+	state.stats_timerfd = -1;
+	#endif
+	METRICS_SetMarker(thread_args->metrics, 0, 0);
+
+	/* Failures below release whatever has been setup so far, as the stream may be restarted */
+	bool ok = false;
 
 	/* Create epoll instance */
 	int epoll_fd = epoll_create1(0);
 	if (epoll_fd < 0)
 	{
 		perror("Failed to create epoll instance");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -139,83 +252,87 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, thread_args->quit_event_fd, &epoll_event) < 0)
 	{
 		perror("Failed to register thread quit eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
 		DEBUG_PRINT("Registered thread quit eventfd with with epoll :-)\n");
 	}
 
-	/* Create IIO context */
-	struct iio_context *iio_ctx = iio_create_local_context();
-	if (!iio_ctx)
+	/* Setup sample sink, IIO device unless checking a test pattern / looping back */
+	size_t sample_size;
+	if ((SDR_USB_GADGET_TEST_PATTERN_NONE == thread_args->config.test_pattern) && (SDR_USB_GADGET_LOOPBACK_NONE == thread_args->config.loopback))
 	{
-		fprintf(stderr, "Failed to open iio\n");
-		return NULL;
+		if (!setup_iio(&state, epoll_fd, &sample_size))
+			goto cleanup;
 	}
-
-	/* Retrieve TX streaming device */
-	struct iio_device *iio_dev_tx = iio_context_find_device(iio_ctx, "cf-ad9361-dds-core-lpc");
-	if (!iio_dev_tx)
+	else
 	{
-		fprintf(stderr, "Failed to open iio tx dev\n");
-		return NULL;
+		if (!setup_bypass(&state, &sample_size))
+			goto cleanup;
 	}
+	state.sample_size = sample_size;
 
-	/* Disable all channels */
-	unsigned int nb_channels = iio_device_get_channels_count(iio_dev_tx);
-	for (unsigned int i = 0; i < nb_channels; i++)
+	TIME_QUEUE_Init(&state.schedule, state.schedule_data, ARRAY_SIZE(state.schedule_data));
+
+	/* Prime before first push if required */
+	RING_BUFFER_Init(&state.prefill_ctx, ARRAY_SIZE(state.prefill_data));
+	state.priming = (thread_args->config.prefill > 0);
+
+	/* Calculate USB buffer size */
+	state.usb_buffer_size = state.header_size + (sample_size * state.iio_samples);
+	if (state.usb_buffer_size > STREAM_CONFIG_MAX_USB_BUFFER_SIZE)
 	{
-		iio_channel_disable(iio_device_get_channel(iio_dev_tx, i));
+		fprintf(stderr, "USB buffer size %zu exceeds maximum of %u bytes\n", state.usb_buffer_size, STREAM_CONFIG_MAX_USB_BUFFER_SIZE);
+		goto cleanup;
 	}
-
-	/* Enable required channels */
-	for (unsigned int i = 0; i < 32; i++)
+	if (thread_args->isochronous && (0 != (state.usb_buffer_size % thread_args->max_packet_size)))
 	{
-		/* Enable channel if required */
-		if (thread_args->iio_channels & (1U << i))
-		{
-			/* Retrieve channel */
-			struct iio_channel *channel = iio_device_get_channel(iio_dev_tx, i);
-			if (!channel)
-			{
-				fprintf(stderr, "Failed to find iio rx chan %u\n", i);
-				return NULL;
-			}
-
-			/* Enable channels */
-			iio_channel_enable(channel);
-		}
+		/* Transfers must span whole service intervals, such that each buffer occupies a fixed number of (micro)frames */
+		fprintf(stderr, "TX usb buffer size %zu not a multiple of isochronous bytes per interval (%u)\n", state.usb_buffer_size, thread_args->max_packet_size);
+		goto cleanup;
 	}
-
-	/* Create non-cyclic buffer */
-	state.iio_tx_buffer = iio_device_create_buffer(iio_dev_tx, thread_args->iio_buffer_size, false);
-	if (!state.iio_tx_buffer)
+	else if ((thread_args->max_packet_size > 0) && (0 != (state.usb_buffer_size % thread_args->max_packet_size)))
 	{
-		fprintf(stderr, "Failed to create tx buffer for %zu samples\n", thread_args->iio_buffer_size);
-		return NULL;
+		/* A short packet ends each transfer, host writes larger than a buffer will be split across several */
+		DEBUG_PRINT("TX usb buffer size not a multiple of max packet size (%u), host should write whole buffers\n", thread_args->max_packet_size);
+	}
+	state.num_buffers = thread_args->config.queue_depth;
+	if (thread_args->config.cyclic)
+	{
+		/* Waveforms are uploaded occasionally and may be large, only one upload need be outstanding */
+		state.num_buffers = 1;
 	}
 
-	/* Retrieve number of bytes between two samples of the same channel (aka size of one sample of all enabled channels) */
-	size_t sample_size = iio_buffer_step(state.iio_tx_buffer);
-
-	/* Calculate USB buffer size */
-	state.usb_buffer_size = sample_size * thread_args->iio_buffer_size;
+	/* Publish configuration */
+	METRICS_SetConfig(thread_args->metrics, thread_args->config.enabled_channels, thread_args->config.buffer_size, state.usb_buffer_size, state.num_buffers);
 
 	/* Summarize info */
-	DEBUG_PRINT("TX sample count: %zu, iio sample size: %zu, usb buffer size: %zu\n",
-				thread_args->iio_buffer_size,
+	DEBUG_PRINT("TX sample count: %zu, iio sample size: %zu, timestamp size: %zu, usb buffer size: %zu, queue depth: %u\n",
+				state.iio_samples,
 				sample_size,
-				state.usb_buffer_size);
+				state.header_size,
+				state.usb_buffer_size,
+				state.num_buffers);
+	if (thread_args->isochronous)
+	{
+		uint32_t intervals = state.usb_buffer_size / thread_args->max_packet_size;
+		DEBUG_PRINT("TX isochronous transfer spans %" PRIu32 " intervals, queued data bounded to %" PRIu64 "us\n", intervals, (uint64_t)intervals * state.num_buffers * thread_args->interval_us);
+	}
 
 	/* Reset AIO context */
 	memset(&state.io_ctx, 0x00, sizeof(state.io_ctx));
 
-	/* Setup AIO context */
-	if (io_setup(ARRAY_SIZE(state.buffers), &state.io_ctx) < 0)
+	/* Setup AIO context (copy loopback sending from its own buffers while transfers are requeued) */
+	unsigned int max_requests = state.num_buffers;
+	if (SDR_USB_GADGET_LOOPBACK_COPY == thread_args->config.loopback)
+	{
+		max_requests *= 2;
+	}
+	if (io_setup(max_requests, &state.io_ctx) < 0)
 	{
 		perror("Failed to setup AIO");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -227,7 +344,7 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	if (state.aio_eventfd < 0)
 	{
 		perror("Failed to open eventfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -241,7 +358,7 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	{
 		/* Failed to register aio completion eventfd with epoll */
 		perror("Failed to register aio completion eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -250,16 +367,17 @@ void *THREAD_WRITE_Entrypoint(void *args)
 
 	/* Allocate buffers */
 	struct iocb* bufs[ARRAY_SIZE(state.buffers)];
-	for (unsigned int i = 0; i < ARRAY_SIZE(state.buffers); i++)
+	for (unsigned int i = 0; i < state.num_buffers; i++)
 	{
 		/* Allocate buffer */
 		usb_buf_t *buf = alloc_usb_buffer(state.usb_buffer_size, thread_args->input_fd, state.aio_eventfd);
 		if (!buf)
 		{
-			return NULL;
+			goto cleanup;
 		}
 
 		/* Store buffer */
+		buf->index = (uint16_t)i;
 		state.buffers[i] = buf;
 
 		/* Mark buffer as in use */
@@ -269,13 +387,89 @@ void *THREAD_WRITE_Entrypoint(void *args)
 		bufs[i] = &buf->iocb;
 	}
 
+	/* Allocate buffer to reassemble short transfers into (swapping places with transfers as buffers complete) */
+	state.assembly = alloc_usb_buffer(state.usb_buffer_size, thread_args->input_fd, state.aio_eventfd);
+	if (!state.assembly)
+	{
+		goto cleanup;
+	}
+	state.assembly->index = (uint16_t)state.num_buffers;
+	state.buffers[state.num_buffers] = state.assembly;
+
+	/* Allocate buffers to copy looped back transfers into if required */
+	RING_BUFFER_Init(&state.loopback_ctx, state.num_buffers);
+	if (SDR_USB_GADGET_LOOPBACK_COPY == thread_args->config.loopback)
+	{
+		for (unsigned int i = 0; i < state.num_buffers; i++)
+		{
+			usb_buf_t *buf = alloc_usb_buffer(state.usb_buffer_size, thread_args->loopback_fd, state.aio_eventfd);
+			if (!buf)
+			{
+				goto cleanup;
+			}
+			buf->index = (uint16_t)i;
+			state.loopback_buffers[i] = buf;
+			state.loopback_data[RING_BUFFER_Put(&state.loopback_ctx)] = buf;
+		}
+	}
+
+	/* Create underrun watchdog if required, firing should no USB buffer arrive before the queued buffers are output */
+	if (SDR_USB_GADGET_UNDERRUN_POLICY_NONE != thread_args->config.underrun_policy)
+	{
+		/* Calculate buffer period from sample rate */
+		long long sample_rate = 0;
+		struct iio_channel *channel = iio_device_find_channel(state.iio_dev_tx, "voltage0", true);
+		if (!channel || (iio_channel_attr_read_longlong(channel, "sampling_frequency", &sample_rate) < 0) || (sample_rate <= 0))
+		{
+			fprintf(stderr, "Failed to retrieve tx sample rate\n");
+			goto cleanup;
+		}
+		uint64_t period_ns = ((uint64_t)state.iio_samples * 1000000000ULL) / (uint64_t)sample_rate;
+		state.watchdog_period_ns = period_ns;
+		state.kernel_buffers = (thread_args->config.prefill > DEFAULT_KERNEL_BUFFERS) ? thread_args->config.prefill : DEFAULT_KERNEL_BUFFERS;
+
+		/* Allocate fill data */
+		state.fill_data = calloc(1, state.usb_buffer_size - state.header_size);
+		if (!state.fill_data)
+		{
+			perror("Failed to allocate fill buffer");
+			goto cleanup;
+		}
+
+		/* Create timer, armed on first push */
+		state.watchdog_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (state.watchdog_timerfd < 0)
+		{
+			perror("Failed to open watchdog timerfd");
+			goto cleanup;
+		}
+		else
+		{
+			DEBUG_PRINT("Opened watchdog timerfd, period %" PRIu64 "ns :-)\n", period_ns);
+		}
+
+		/* Register timer with epoll */
+		epoll_event.events = EPOLLIN;
+		epoll_event.data.ptr = handle_watchdog_timer;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state.watchdog_timerfd, &epoll_event) < 0)
+		{
+			/* Failed to register timer with epoll */
+			perror("Failed to register watchdog timer with epoll");
+			goto cleanup;
+		}
+		else
+		{
+			DEBUG_PRINT("Registered watchdog timer with with epoll :-)\n");
+		}
+	}
+
 	#if GENERATE_STATS
 	/* Create stats reporting timer */
 	state.stats_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
 	if (state.stats_timerfd < 0)
 	{
 		perror("Failed to open timerfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -289,7 +483,7 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	if (timerfd_settime(state.stats_timerfd, 0, &timer_period, NULL) < 0)
 	{
 		perror("Failed to set timerfd");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -303,7 +497,7 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	{
 		/* Failed to register timer with epoll */
 		perror("Failed to register timer eventfd with epoll");
-		return NULL;
+		goto cleanup;
 	}
 	else
 	{
@@ -311,21 +505,38 @@ void *THREAD_WRITE_Entrypoint(void *args)
 	}
 
 	/* Init timers */
-	UTILS_ResetTimeStats(&state.write_period);
-	UTILS_ResetTimeStats(&state.write_dur);
+	UTILS_ResetHistogram(&state.write_period);
+	UTILS_ResetHistogram(&state.write_dur);
+	UTILS_ResetHistogram(&state.aio_latency);
+	state.last_underruns = METRICS_Read(&thread_args->metrics->underruns);
+	#endif
+
+	#if GENERATE_STATS
+	/* Record submit time */
+	uint64_t submit_time = UTILS_GetMonotonicMicros();
+	for (unsigned int i = 0; i < state.num_buffers; i++)
+	{
+		state.buffers[i]->submit_time = submit_time;
+	}
 	#endif
 
 	/* Submit all buffers for reading */
-	int res = io_submit(state.io_ctx, ARRAY_SIZE(bufs), bufs);
-	if (ARRAY_SIZE(bufs) != res)
+	int res = io_submit(state.io_ctx, state.num_buffers, bufs);
+	if ((int)state.num_buffers != res)
 	{
-		fprintf(stderr, "Failed to submit all USB read buffers, req: %zu, act: %d\n", ARRAY_SIZE(bufs), res);
-		return NULL;
+		fprintf(stderr, "Failed to submit all USB read buffers, req: %u, act: %d\n", state.num_buffers, res);
+		goto cleanup;
+	}
+	for (unsigned int i = 0; i < state.num_buffers; i++)
+	{
+		PROBE1(tx_submit, state.buffers[i]->index);
 	}
 
 	/* Enter main loop */
 	DEBUG_PRINT("Enter write loop..\n");
 	state.keep_running = true;
+	METRICS_SetState(thread_args->metrics, SDR_USB_GADGET_STREAM_STATE_RUNNING);
+	NOTIFY_Post(thread_args->notify, SDR_USB_GADGET_EVENT_STREAM_STARTED, 0);
 	while (state.keep_running)
 	{
 		if (EPOLL_LOOP_Run(epoll_fd, 30000, &state) < 0)
@@ -335,9 +546,14 @@ void *THREAD_WRITE_Entrypoint(void *args)
 		}
 	}
 	DEBUG_PRINT("Exit write loop..\n");
+	ok = !state.keep_running;
 
+cleanup:
 	/* Destroy IO context (cancelling any pending transfers) */
-	io_destroy(state.io_ctx);
+	if (state.io_ctx)
+	{
+		io_destroy(state.io_ctx);
+	}
 
 	/* Free buffers after destroying context now kernel won't be using them */
 	for (unsigned int i = 0; i < ARRAY_SIZE(state.buffers); i++)
@@ -346,23 +562,209 @@ void *THREAD_WRITE_Entrypoint(void *args)
 		free(state.buffers[i]);
 		state.buffers[i] = NULL;
 	}
+	for (unsigned int i = 0; i < ARRAY_SIZE(state.loopback_buffers); i++)
+	{
+		free(state.loopback_buffers[i]);
+		state.loopback_buffers[i] = NULL;
+	}
 
 	/* Close / destroy everything */
 	#if GENERATE_STATS
-	close(state.stats_timerfd);
+	if (state.stats_timerfd >= 0)
+	{
+		close(state.stats_timerfd);
+	}
 	#endif
-	close(state.aio_eventfd);
-	iio_buffer_destroy(state.iio_tx_buffer);
-	iio_context_destroy(iio_ctx);
-	close(epoll_fd);
+	if (state.watchdog_timerfd >= 0)
+	{
+		close(state.watchdog_timerfd);
+	}
+	free(state.fill_data);
+	if (state.aio_eventfd >= 0)
+	{
+		close(state.aio_eventfd);
+	}
+	if (state.iio_tx_buffer)
+	{
+		iio_buffer_destroy(state.iio_tx_buffer);
+	}
+	if (state.iio_ctx)
+	{
+		iio_context_destroy(state.iio_ctx);
+	}
+	if (epoll_fd >= 0)
+	{
+		close(epoll_fd);
+	}
 
 	/* Exit */
 	DEBUG_PRINT("Write thread exit\n");
 
-	return NULL;
+	return ok;
+}
+
+static bool setup_iio(state_t *state, int epoll_fd, size_t *sample_size)
+{
+	THREAD_WRITE_Args_t *thread_args = state->thread_args;
+
+	/* Create IIO context */
+	state->iio_ctx = iio_create_local_context();
+	if (!state->iio_ctx)
+	{
+		fprintf(stderr, "Failed to open iio\n");
+		return false;
+	}
+
+	/* Retrieve TX streaming device, as requested or the default */
+	const char *device = thread_args->config.device[0] ? thread_args->config.device : thread_args->default_device;
+	struct iio_device *iio_dev_tx = DEVICE_SELECT_Find(state->iio_ctx, device, true);
+	if (!iio_dev_tx)
+	{
+		fprintf(stderr, "Failed to open iio tx dev: %s\n", device);
+		return false;
+	}
+	DEBUG_PRINT("Using iio tx dev: %s\n", iio_device_get_name(iio_dev_tx));
+	state->iio_dev_tx = iio_dev_tx;
+
+	/* Disable all channels */
+	unsigned int nb_channels = iio_device_get_channels_count(iio_dev_tx);
+	for (unsigned int i = 0; i < nb_channels; i++)
+	{
+		iio_channel_disable(iio_device_get_channel(iio_dev_tx, i));
+	}
+
+	/* Enable required channels */
+	for (unsigned int i = 0; i < 32; i++)
+	{
+		/* Enable channel if required */
+		if (thread_args->config.enabled_channels & (1U << i))
+		{
+			/* Retrieve channel */
+			struct iio_channel *channel = iio_device_get_channel(iio_dev_tx, i);
+			if (!channel)
+			{
+				fprintf(stderr, "Failed to find iio rx chan %u\n", i);
+				return false;
+			}
+
+			/* Enable channels */
+			iio_channel_enable(channel);
+		}
+	}
+
+	/* Reserve space at start of USB buffer for timestamp if required */
+	state->iio_samples = thread_args->config.buffer_size;
+	if (thread_args->config.timestamps)
+	{
+		ssize_t header_sample_size = iio_device_get_sample_size(iio_dev_tx);
+		if (header_sample_size <= 0)
+		{
+			fprintf(stderr, "Failed to retrieve tx sample size\n");
+			return false;
+		}
+		if (!reserve_header(state, header_sample_size))
+			return false;
+	}
+
+	if (thread_args->config.cyclic)
+	{
+		/* Cyclic buffers are created as each waveform is uploaded, retrieve size of one sample of all enabled channels */
+		ssize_t size = iio_device_get_sample_size(iio_dev_tx);
+		if (size <= 0)
+		{
+			fprintf(stderr, "Failed to retrieve tx sample size\n");
+			return false;
+		}
+		*sample_size = size;
+	}
+	else
+	{
+		/* Allow kernel to queue all prefilled buffers, such that they're pushed without blocking */
+		if (thread_args->config.prefill > DEFAULT_KERNEL_BUFFERS)
+		{
+			if (iio_device_set_kernel_buffers_count(iio_dev_tx, thread_args->config.prefill) < 0)
+			{
+				fprintf(stderr, "Failed to set tx kernel buffer count to %" PRIu32 "\n", thread_args->config.prefill);
+				return false;
+			}
+		}
+
+		/* Create non-cyclic buffer */
+		state->iio_tx_buffer = iio_device_create_buffer(iio_dev_tx, state->iio_samples, false);
+		if (!state->iio_tx_buffer)
+		{
+			fprintf(stderr, "Failed to create tx buffer for %zu samples\n", state->iio_samples);
+			return false;
+		}
+
+		/* Retrieve number of bytes between two samples of the same channel (aka size of one sample of all enabled channels) */
+		*sample_size = iio_buffer_step(state->iio_tx_buffer);
+	}
+
+	/* Planar layout is consumed by interleaving 16-bit words */
+	if (SDR_USB_GADGET_WIRE_FORMAT_PLANAR == thread_args->config.wire_format)
+	{
+		state->num_channels = __builtin_popcount(thread_args->config.enabled_channels);
+		if (*sample_size != (state->num_channels * sizeof(int16_t)))
+		{
+			fprintf(stderr, "Planar wire format requires 16-bit channels, sample size: %zu\n", *sample_size);
+			return false;
+		}
+	}
+
+	/* Timed buffers are released as the DAC consumes samples, register buffer with epoll to be told when there's space */
+	if (thread_args->config.timestamps)
+	{
+		struct epoll_event epoll_event;
+		epoll_event.events = EPOLLOUT;
+		epoll_event.data.ptr = handle_iio_buffer;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, iio_buffer_get_poll_fd(state->iio_tx_buffer), &epoll_event) < 0)
+		{
+			/* Failed to register IIO buffer with epoll */
+			perror("Failed to register IIO buffer with epoll");
+			return false;
+		}
+		else
+		{
+			DEBUG_PRINT("Registered IIO buffer with with epoll :-)\n");
+		}
+	}
+
+	return true;
+}
+
+static bool setup_bypass(state_t *state, size_t *sample_size)
+{
+	THREAD_WRITE_Args_t *thread_args = state->thread_args;
+
+	/* Samples are a 16-bit word per enabled channel, as the AD9361's */
+	unsigned int num_channels = __builtin_popcount(thread_args->config.enabled_channels);
+	*sample_size = num_channels * sizeof(uint16_t);
+	TEST_PATTERN_Init(&state->pattern, thread_args->config.test_pattern, num_channels);
+	DEBUG_PRINT("Bypassing IIO, test pattern: %u, loopback: %u\n", thread_args->config.test_pattern, thread_args->config.loopback);
+
+	/* Reserve space at start of USB buffer for timestamp if required */
+	state->iio_samples = thread_args->config.buffer_size;
+	if (thread_args->config.timestamps && !reserve_header(state, *sample_size))
+		return false;
+
+	return true;
+}
+
+static bool reserve_header(state_t *state, size_t sample_size)
+{
+	uint32_t header_samples = STREAM_CONFIG_TimestampSamples(sample_size);
+	if (state->iio_samples <= header_samples)
+	{
+		fprintf(stderr, "TX buffer of %zu samples too small for %" PRIu32 " sample timestamp\n", state->iio_samples, header_samples);
+		return false;
+	}
+	state->iio_samples -= header_samples;
+	state->header_size = header_samples * sample_size;
+
+	return true;
 }
 
-/* Private functions */
 static int handle_eventfd_thread(state_t *state)
 {
 	/* Quit having detected write on eventfd */
@@ -374,7 +776,7 @@ static int handle_eventfd_thread(state_t *state)
 
 static int handle_eventfd_aio(state_t *state)
 {
-	struct io_event events[ARRAY_SIZE(state->buffers)];
+	struct io_event events[ARRAY_SIZE(state->buffers) + ARRAY_SIZE(state->loopback_buffers)];
 
 	/* Read eventfd to reset it */
 	uint64_t dummy;
@@ -401,60 +803,225 @@ static int handle_eventfd_aio(state_t *state)
 
 		/* Retrieve buffer */
 		usb_buf_t *buf = (usb_buf_t*)event->data;
-
-		/* Check for success */
-		if (state->usb_buffer_size == (size_t)event->res)
+		if (IO_CMD_PWRITE == buf->iocb.aio_lio_opcode)
 		{
-			/* Copy data into buffer */
-			memcpy(iio_buffer_start(state->iio_tx_buffer), buf->data, state->usb_buffer_size);
+			/* Looped back transfer sent */
+			if (handle_loopback_complete(state, buf, event) < 0)
+				return -1;
+			continue;
+		}
+		buf->sequence = state->sequence++;
+		TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_COMPLETE, buf->index, buf->sequence);
+		PROBE3(tx_complete, buf->index, buf->sequence, (long)event->res);
 
-			#if GENERATE_STATS
-			/* Capture write period */
-			UTILS_UpdateTimeStats(&state->write_period);
+		#if GENERATE_STATS
+		/* Capture submit to complete latency */
+		UTILS_RecordHistogram(&state->aio_latency, UTILS_GetMonotonicMicros() - buf->submit_time);
+		#endif
 
-			/* Record write start time */
-			UTILS_StartTimeStats(&state->write_dur);
-			#endif
+		/* Check for success (transfers may be short, the host being free to send in whatever size suits it) */
+		if ((long)event->res >= 0)
+		{
+			/* Count transfer */
+			METRICS_Add(&state->thread_args->metrics->bytes, event->res);
+			METRICS_Add(&state->thread_args->metrics->buffers, 1);
 
-			/* Perform blocking write */
-			ssize_t nbytes = iio_buffer_push(state->iio_tx_buffer);
-			if (nbytes != (ssize_t)state->usb_buffer_size)
+			/* Send transfer back out as received, bypassing reassembly */
+			if (SDR_USB_GADGET_LOOPBACK_NONE != state->thread_args->config.loopback)
 			{
-				#if GENERATE_STATS
-				/* Count overflow */
-				state->overflows++;
-				#endif
+				if (loop_back(state, buf, event->res) < 0)
+					return -1;
+				continue;
 			}
 
-			#if GENERATE_STATS
-			/* Capture write end time */
-			UTILS_UpdateTimeStats(&state->write_dur);
+			/* Append to buffer being reassembled, retrieving a complete buffer if available */
+			usb_buf_t *complete = reassemble(state, buf, event->res);
+			if (!complete)
+			{
+				/* Re-submit transfer, its data having been consumed */
+				if (submit_usb_buffer(state, buf) < 0)
+					return -1;
+				continue;
+			}
+			buf = complete;
 
-			/* Record period start time (to subtract write time above) */
-			UTILS_StartTimeStats(&state->write_period);
-			#endif
+			if (SDR_USB_GADGET_TEST_PATTERN_NONE != state->thread_args->config.test_pattern)
+			{
+				/* Swallow buffer, having checked its contents */
+				check_pattern(state, buf);
+			}
+			else if (state->thread_args->config.timestamps)
+			{
+				/* Hold buffer until its timestamp is reached, re-submitting it once pushed */
+				uint64_t timestamp;
+				memcpy(&timestamp, buf->data, sizeof(timestamp));
+				TIME_QUEUE_Push(&state->schedule, timestamp, buf);
+				continue;
+			}
+			else if (state->thread_args->config.cyclic)
+			{
+				/* Replace waveform being repeated */
+				if (!load_waveform(state, buf))
+					return -1;
+			}
+			else if (state->priming)
+			{
+				/* Hold buffer until enough have accumulated, then push them back to back */
+				state->prefill_data[RING_BUFFER_Put(&state->prefill_ctx)] = buf;
+				if (state->prefill_ctx.usage < state->thread_args->config.prefill)
+					continue;
+
+				DEBUG_PRINT("Primed with %" PRIu32 " buffers\n", state->prefill_ctx.usage);
+				state->priming = false;
+				uint32_t index;
+				while (RING_BUFFER_NO_INDEX != (index = RING_BUFFER_Get(&state->prefill_ctx)))
+				{
+					usb_buf_t *primed = state->prefill_data[index];
+					push_buffer(state, primed);
+					if ((primed != buf) && (submit_usb_buffer(state, primed) < 0))
+						return -1;
+				}
+			}
+			else
+			{
+				/* Push immediately */
+				push_buffer(state, buf);
+			}
 		}
-		else if (-ESHUTDOWN != (long)event->res)
+		else if (-ESHUTDOWN == (long)event->res)
 		{
-			/* Not all data was read, or read failed. But error wasn't due to configuration being disabled */
+			/* Read failed due to configuration being disabled */
+			METRICS_Add(&state->thread_args->metrics->shutdowns, 1);
+		}
+		else if (state->thread_args->isochronous)
+		{
+			/* Isochronous transfer corrupt or missed, report loss without retrying */
+			METRICS_Add(&state->thread_args->metrics->lost, 1);
+			NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_LOSS, state->sample_count);
+		}
+		else
+		{
+			/* Read failed */
 			fprintf(stderr, "USB read completed with error, res: %ld, res2: %ld\n", event->res, event->res2);
+			METRICS_Add(&state->thread_args->metrics->aio_errors, 1);
 		}
 
 		/* Re-submit buffer */
-		struct iocb *iocb = &buf->iocb;
-		int res = io_submit(state->io_ctx, 1, &iocb);
-		if (1 != res)
-		{
-			/* Failed to submit context */
-			perror("Failed to submit usb read");
-			buf->in_use = false;
+		if (submit_usb_buffer(state, buf) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int handle_iio_buffer(state_t *state)
+{
+	const TIME_QUEUE_Entry_t *next;
+	TIME_QUEUE_Entry_t entry;
+
+	/* Drop buffers whose time has passed, reporting them to the host */
+	while ((next = TIME_QUEUE_Peek(&state->schedule)) && (next->time < state->sample_count))
+	{
+		TIME_QUEUE_Pop(&state->schedule, &entry);
+		usb_buf_t *buf = (usb_buf_t*)entry.item;
+		METRICS_Add(&state->thread_args->metrics->late, 1);
+		PROBE2(tx_late, buf->sequence, entry.time);
+		NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_LATE, entry.time);
+		if (submit_usb_buffer(state, buf) < 0)
 			return -1;
+	}
+
+	/* Push buffer if due */
+	if (next && (next->time == state->sample_count))
+	{
+		TIME_QUEUE_Pop(&state->schedule, &entry);
+		usb_buf_t *buf = (usb_buf_t*)entry.item;
+		push_buffer(state, buf);
+		return submit_usb_buffer(state, buf);
+	}
+
+	/* Otherwise fill with zeros up to next buffer (or for a whole buffer if none are queued) */
+	uint64_t gap = next ? (next->time - state->sample_count) : state->iio_samples;
+	push_zeros(state, (gap < state->iio_samples) ? gap : state->iio_samples);
+
+	return 0;
+}
+
+static int handle_watchdog_timer(state_t *state)
+{
+	/* Read timer to acknowledge it */
+	uint64_t timerfd_val;
+	if (read(state->watchdog_timerfd, &timerfd_val, sizeof(timerfd_val)) < 0)
+	{
+		perror("Failed to read watchdog timerfd");
+		return -1;
+	}
+
+	/* No USB buffer arrived before the queued buffers were output, push fill data such that the DAC doesn't starve */
+	uint8_t *dest = iio_buffer_start(state->iio_tx_buffer);
+	size_t size = state->usb_buffer_size - state->header_size;
+	switch (state->thread_args->config.underrun_policy)
+	{
+		case SDR_USB_GADGET_UNDERRUN_POLICY_REPEAT:
+		{
+			memcpy(dest, state->fill_data, size);
+			break;
+		}
+		case SDR_USB_GADGET_UNDERRUN_POLICY_HOLD:
+		{
+			for (size_t offset = 0; offset < size; offset += state->sample_size)
+			{
+				memcpy(dest + offset, state->fill_data, state->sample_size);
+			}
+			break;
+		}
+		default:
+		{
+			memset(dest, 0x00, size);
+			break;
 		}
 	}
+	ssize_t nbytes = iio_buffer_push(state->iio_tx_buffer);
+
+	/* Count underrun, reporting the position at which fill data was inserted */
+	METRICS_Add(&state->thread_args->metrics->underruns, 1);
+	PROBE2(tx_underrun, state->sequence, (long)nbytes);
+	NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_UNDERRUN, state->sample_count);
+	state->sample_count += state->iio_samples;
+
+	/* Prime again if required */
+	state->priming = (state->thread_args->config.prefill > 0);
+
+	/* Fill again once this buffer has been output, unless the host catches up */
+	restart_watchdog(state);
 
 	return 0;
 }
 
+static void restart_watchdog(state_t *state)
+{
+	/* Each push queues another buffer period behind those still queued, up to the number of kernel buffers */
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_ns = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+	uint64_t limit_ns = now_ns + (state->kernel_buffers * state->watchdog_period_ns);
+	state->drain_time_ns = ((state->drain_time_ns > now_ns) ? state->drain_time_ns : now_ns) + state->watchdog_period_ns;
+	if (state->drain_time_ns > limit_ns)
+	{
+		state->drain_time_ns = limit_ns;
+	}
+
+	/* Fire once the DAC should have output everything queued, such that fill data never delays buffers already pushed */
+	struct itimerspec expiry =
+	{
+		.it_value = { .tv_sec = state->drain_time_ns / 1000000000ULL, .tv_nsec = state->drain_time_ns % 1000000000ULL },
+	};
+	if (timerfd_settime(state->watchdog_timerfd, TFD_TIMER_ABSTIME, &expiry, NULL) < 0)
+	{
+		perror("Failed to set watchdog timerfd");
+	}
+}
+
 #if GENERATE_STATS
 static int handle_stats_timer(state_t *state)
 {
@@ -466,35 +1033,319 @@ static int handle_stats_timer(state_t *state)
 		return 1;
 	}
 
-	/* Report min/max/average write period */
-	printf("Write period: min: %"PRIu64", max: %"PRIu64", avg: %"PRIu64" (uS)\n",
-		   state->write_period.min,
-		   state->write_period.max,
-		   UTILS_CalcAverageTimeStats(&state->write_period)
-	);
+	/* Report write period, push duration and AIO latency distributions */
+	UTILS_PrintHistogram("Write period", &state->write_period);
+	UTILS_PrintHistogram("Push dur", &state->write_dur);
+	UTILS_PrintHistogram("USB read AIO latency", &state->aio_latency);
 
-	/* Report min/max/average write duration */
-	printf("Write dur: min: %"PRIu64", max: %"PRIu64", avg: %"PRIu64" (uS)\n",
-		   state->write_dur.min,
-		   state->write_dur.max,
-		   UTILS_CalcAverageTimeStats(&state->write_dur)
-	);
-
-	/* Check for overflows */
-	if (state->overflows > 0)
+	/* Check for underruns */
+	uint64_t underruns = METRICS_Read(&state->thread_args->metrics->underruns);
+	if (underruns != state->last_underruns)
 	{
-		printf("Read overflows: %u in last 5s period\n", state->overflows);
+		printf("Write underruns: %"PRIu64" in last %us period\n", underruns - state->last_underruns, STATS_PERIOD_SECS);
 	}
 
-	/* Reset stats */
-	UTILS_ResetTimeStats(&state->write_period);
-	UTILS_ResetTimeStats(&state->write_dur);
-	state->overflows = 0;
+	/* Reset stats, unless cumulative view requested */
+	if (!cumulative_stats)
+	{
+		UTILS_ResetHistogram(&state->write_period);
+		UTILS_ResetHistogram(&state->write_dur);
+		UTILS_ResetHistogram(&state->aio_latency);
+	}
+	state->last_underruns = underruns;
 
 	return 0;
 }
 #endif
 
+static usb_buf_t *reassemble(state_t *state, usb_buf_t *buf, size_t length)
+{
+	/* Complete buffer received with nothing pending, use as is */
+	if ((0 == state->assembly_fill) && (state->usb_buffer_size == length))
+		return buf;
+
+	/* Append to buffer being reassembled */
+	usb_buf_t *complete = state->assembly;
+	size_t count = state->usb_buffer_size - state->assembly_fill;
+	if (count > length)
+	{
+		count = length;
+	}
+	memcpy(complete->data + state->assembly_fill, buf->data, count);
+	state->assembly_fill += count;
+	if (state->assembly_fill < state->usb_buffer_size)
+		return NULL;
+
+	/* Buffer complete, received transfer takes its place, keeping any data which belongs to the next buffer */
+	memmove(buf->data, buf->data + count, length - count);
+	state->assembly = buf;
+	state->assembly_fill = length - count;
+	complete->sequence = buf->sequence;
+
+	return complete;
+}
+
+static void push_buffer(state_t *state, usb_buf_t *buf)
+{
+	/* Copy data into buffer (skipping timestamp) */
+	if (SDR_USB_GADGET_WIRE_FORMAT_PLANAR == state->thread_args->config.wire_format)
+	{
+		SAMPLE_FORMAT_Interleave16(iio_buffer_start(state->iio_tx_buffer), (const int16_t*)(buf->data + state->header_size), state->num_channels, state->iio_samples);
+	}
+	else
+	{
+		memcpy(iio_buffer_start(state->iio_tx_buffer), buf->data + state->header_size, state->usb_buffer_size - state->header_size);
+	}
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_COPY, buf->index, buf->sequence);
+	if (state->thread_args->mark_loopback && !state->marked)
+	{
+		mark_first_sample(state, iio_buffer_start(state->iio_tx_buffer), (state->usb_buffer_size - state->header_size) / sizeof(uint16_t));
+	}
+
+	#if GENERATE_STATS
+	/* Capture write period */
+	UTILS_UpdateHistogram(&state->write_period);
+
+	/* Record write start time */
+	UTILS_StartHistogram(&state->write_dur);
+	#endif
+
+	/* Perform blocking write */
+	ssize_t nbytes = iio_buffer_push(state->iio_tx_buffer);
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_PUSH, buf->index, buf->sequence);
+	if (nbytes != (ssize_t)(state->usb_buffer_size - state->header_size))
+	{
+		/* Count underrun */
+		METRICS_Add(&state->thread_args->metrics->underruns, 1);
+		PROBE2(tx_underrun, buf->sequence, (long)nbytes);
+
+		/* Notify host */
+		NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_UNDERRUN, state->sample_count);
+
+		/* Prime again if required */
+		state->priming = (state->thread_args->config.prefill > 0);
+	}
+	state->sample_count += state->iio_samples;
+
+	#if GENERATE_STATS
+	/* Capture write end time */
+	UTILS_UpdateHistogram(&state->write_dur);
+
+	/* Record period start time (to subtract write time above) */
+	UTILS_StartHistogram(&state->write_period);
+	#endif
+
+	if (state->watchdog_timerfd >= 0)
+	{
+		/* Capture data to be pushed on underrun (in IIO layout) */
+		size_t size = state->usb_buffer_size - state->header_size;
+		const uint8_t *data = buf->data + state->header_size;
+		bool planar = (SDR_USB_GADGET_WIRE_FORMAT_PLANAR == state->thread_args->config.wire_format);
+		if (SDR_USB_GADGET_UNDERRUN_POLICY_REPEAT == state->thread_args->config.underrun_policy)
+		{
+			if (planar)
+			{
+				SAMPLE_FORMAT_Interleave16((int16_t*)state->fill_data, (const int16_t*)data, state->num_channels, state->iio_samples);
+			}
+			else
+			{
+				memcpy(state->fill_data, data, size);
+			}
+		}
+		else if (SDR_USB_GADGET_UNDERRUN_POLICY_HOLD == state->thread_args->config.underrun_policy)
+		{
+			if (planar)
+			{
+				/* Last word of each channel's block */
+				for (unsigned int channel = 0; channel < state->num_channels; channel++)
+				{
+					memcpy(state->fill_data + (channel * sizeof(int16_t)), data + (((channel + 1) * state->iio_samples) - 1) * sizeof(int16_t), sizeof(int16_t));
+				}
+			}
+			else
+			{
+				memcpy(state->fill_data, data + size - state->sample_size, state->sample_size);
+			}
+		}
+
+		/* Restart watchdog */
+		restart_watchdog(state);
+	}
+}
+
+static void push_zeros(state_t *state, size_t count)
+{
+	/* Zero required portion of buffer */
+	memset(iio_buffer_start(state->iio_tx_buffer), 0x00, count * state->sample_size);
+
+	/* Push, the buffer having space (as reported by poll) such that this won't block */
+	ssize_t nbytes = iio_buffer_push_partial(state->iio_tx_buffer, count);
+	if (nbytes != (ssize_t)(count * state->sample_size))
+	{
+		/* Count underrun */
+		METRICS_Add(&state->thread_args->metrics->underruns, 1);
+		PROBE2(tx_underrun, state->sequence, (long)nbytes);
+
+		/* Notify host */
+		NOTIFY_Post(state->thread_args->notify, SDR_USB_GADGET_EVENT_UNDERRUN, state->sample_count);
+	}
+	state->sample_count += count;
+}
+
+static void mark_first_sample(state_t *state, const uint16_t *data, size_t words)
+{
+	/* Publish index of first non-zero sample (being pushed now), for the RX stream to find when digitally looped back */
+	for (size_t i = 0; i < words; i++)
+	{
+		if (data[i])
+		{
+			METRICS_SetMarker(state->thread_args->metrics, state->sample_count + ((i * sizeof(uint16_t)) / state->sample_size), UTILS_GetMonotonicMicros());
+			state->marked = true;
+			break;
+		}
+	}
+}
+
+static void check_pattern(state_t *state, usb_buf_t *buf)
+{
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_COPY, buf->index, buf->sequence);
+
+	/* Check data (skipping timestamp), counting discontinuities and corrupt words */
+	bool gap;
+	size_t words = (state->usb_buffer_size - state->header_size) / sizeof(uint16_t);
+	size_t errors = TEST_PATTERN_Check(&state->pattern, (const uint16_t*)(buf->data + state->header_size), words, &gap);
+	if (gap)
+	{
+		DEBUG_PRINT("Test pattern gap in buffer %" PRIu32 "\n", buf->sequence);
+		METRICS_Add(&state->thread_args->metrics->gaps, 1);
+	}
+	if (errors > 0)
+	{
+		DEBUG_PRINT("Test pattern corrupt in buffer %" PRIu32 ", %zu words\n", buf->sequence, errors);
+		METRICS_Add(&state->thread_args->metrics->corrupt, errors);
+	}
+	state->sample_count += state->iio_samples;
+}
+
+static int loop_back(state_t *state, usb_buf_t *buf, size_t length)
+{
+	/* Nothing to send for a zero length packet */
+	if (0 == length)
+		return submit_usb_buffer(state, buf);
+
+	/* Send from received buffer (zero-copy), or a copy of it, requeuing the received buffer at once */
+	usb_buf_t *send = buf;
+	if (SDR_USB_GADGET_LOOPBACK_COPY == state->thread_args->config.loopback)
+	{
+		uint32_t index = RING_BUFFER_Get(&state->loopback_ctx);
+		if (RING_BUFFER_NO_INDEX == index)
+		{
+			/* All copies still being sent, drop transfer */
+			METRICS_Add(&state->thread_args->loopback_metrics->overflows, 1);
+			return submit_usb_buffer(state, buf);
+		}
+		send = state->loopback_data[index];
+		memcpy(send->data, buf->data, length);
+		send->sequence = buf->sequence;
+		TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_COPY, buf->index, buf->sequence);
+		if (submit_usb_buffer(state, buf) < 0)
+			return -1;
+	}
+
+	/* Prepare write of data received */
+	io_prep_pwrite(&send->iocb, state->thread_args->loopback_fd, send->data, length, 0);
+	send->iocb.data = send;
+	io_set_eventfd(&send->iocb, state->aio_eventfd);
+
+	return submit_usb_buffer(state, send);
+}
+
+static int handle_loopback_complete(state_t *state, usb_buf_t *buf, const struct io_event *event)
+{
+	METRICS_Thread_t *metrics = state->thread_args->loopback_metrics;
+	TRACE_Record(state->thread_args->trace, TRACE_STAGE_TX_PUSH, buf->index, buf->sequence);
+
+	/* Count as RX transfer */
+	if ((long)event->res >= 0)
+	{
+		METRICS_Add(&metrics->bytes, event->res);
+		METRICS_Add(&metrics->buffers, 1);
+	}
+	else if (-ESHUTDOWN == (long)event->res)
+	{
+		METRICS_Add(&metrics->shutdowns, 1);
+	}
+	else if (state->thread_args->isochronous)
+	{
+		METRICS_Add(&metrics->lost, 1);
+	}
+	else
+	{
+		fprintf(stderr, "USB loopback write completed with error, res: %ld, res2: %ld\n", event->res, event->res2);
+		METRICS_Add(&metrics->aio_errors, 1);
+	}
+
+	/* Return copy to ring */
+	if (SDR_USB_GADGET_LOOPBACK_COPY == state->thread_args->config.loopback)
+	{
+		state->loopback_data[RING_BUFFER_Put(&state->loopback_ctx)] = buf;
+		return 0;
+	}
+
+	/* Requeue received buffer for reading */
+	io_prep_pread(&buf->iocb, state->thread_args->input_fd, buf->data, state->usb_buffer_size, 0);
+	buf->iocb.data = buf;
+	io_set_eventfd(&buf->iocb, state->aio_eventfd);
+
+	return submit_usb_buffer(state, buf);
+}
+
+static bool load_waveform(state_t *state, usb_buf_t *buf)
+{
+	/* A cyclic buffer can only be pushed once, destroy any previous waveform (the DAC idling until the new one is pushed) */
+	if (state->iio_tx_buffer)
+	{
+		iio_buffer_destroy(state->iio_tx_buffer);
+	}
+
+	/* Create cyclic buffer */
+	state->iio_tx_buffer = iio_device_create_buffer(state->iio_dev_tx, state->iio_samples, true);
+	if (!state->iio_tx_buffer)
+	{
+		fprintf(stderr, "Failed to create cyclic tx buffer for %zu samples\n", state->iio_samples);
+		return false;
+	}
+
+	/* Push waveform, repeated by DMA from now on */
+	push_buffer(state, buf);
+	DEBUG_PRINT("Loaded waveform of %zu samples\n", state->iio_samples);
+
+	return true;
+}
+
+static int submit_usb_buffer(state_t *state, usb_buf_t *buf)
+{
+	#if GENERATE_STATS
+	/* Record submit time */
+	buf->submit_time = UTILS_GetMonotonicMicros();
+	#endif
+
+	/* Submit request */
+	struct iocb *iocb = &buf->iocb;
+	int res = io_submit(state->io_ctx, 1, &iocb);
+	if (1 != res)
+	{
+		/* Failed to submit context */
+		perror("Failed to submit usb read");
+		METRICS_Add(&state->thread_args->metrics->aio_errors, 1);
+		buf->in_use = false;
+		return -1;
+	}
+	PROBE1(tx_submit, buf->index);
+
+	return 0;
+}
+
 static usb_buf_t *alloc_usb_buffer(size_t size, int usb_fd, int event_fd)
 {
 	usb_buf_t *buf;
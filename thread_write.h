@@ -5,20 +5,54 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/* Local modules */
+#include "metrics.h"
+#include "notify.h"
+#include "stream_config.h"
+#include "trace.h"
+
 /* Type definitions - thread args */
 typedef struct
 {
 	/* Eventfd used to signal thread to quit */
 	int quit_event_fd;
 
+	/* Eventfd written by thread as it exits */
+	int done_event_fd;
+
 	/* USB endpoint to read from */
 	int input_fd;
 
-	/* Enabled channels */
-	uint32_t iio_channels;
+	/* Stream configuration */
+	STREAM_CONFIG_Params_t config;
+
+	/* IIO device used when the configuration doesn't name one (name / id, or DEVICE_SELECT_AUTO) */
+	const char *default_device;
+
+	/* Endpoint max packet size at negotiated speed (in bytes, per (micro)frame if isochronous) */
+	uint32_t max_packet_size;
+
+	/* Endpoint is isochronous, failed transfers being reported as lost rather than errors */
+	bool isochronous;
+
+	/* Isochronous service interval (microseconds, each carrying max_packet_size bytes) */
+	uint32_t interval_us;
+
+	/* Interface's RX stream has digital loopback enabled, the first non-zero sample pushed being published as its marker */
+	bool mark_loopback;
+
+	/* Runtime counters */
+	METRICS_Thread_t *metrics;
+
+	/* USB endpoint to loop transfers back out of, and its counters (the interface's RX, stopped while looping back) */
+	int loopback_fd;
+	METRICS_Thread_t *loopback_metrics;
+
+	/* Buffer lifecycle trace (NULL if disabled) */
+	TRACE_Ring_t *trace;
 
-	/* Sample buffer size (in samples) */
-	size_t iio_buffer_size;
+	/* Host event notifications */
+	NOTIFY_Source_t *notify;
 
 } THREAD_WRITE_Args_t;
 
@@ -0,0 +1,75 @@
+/* Public header */
+#include "time_queue.h"
+
+/* Standard / system libraries */
+#include <stddef.h>
+#include <string.h>
+
+/* Public functions */
+void TIME_QUEUE_Init(TIME_QUEUE_Ctx_t *ctx, TIME_QUEUE_Entry_t *entries, uint32_t capacity)
+{
+	/* Reset context */
+	memset(ctx, 0x00, sizeof(*ctx));
+
+	/* Store entries / capacity */
+	ctx->entries = entries;
+	ctx->capacity = capacity;
+}
+
+bool TIME_QUEUE_Push(TIME_QUEUE_Ctx_t *ctx, uint64_t time, void *item)
+{
+	if (ctx->usage >= ctx->capacity)
+		return false;
+
+	/* Sift up from end, moving later parents down until position found */
+	uint32_t index = ctx->usage++;
+	while (index > 0)
+	{
+		uint32_t parent = (index - 1) / 2;
+		if (ctx->entries[parent].time <= time)
+			break;
+
+		ctx->entries[index] = ctx->entries[parent];
+		index = parent;
+	}
+	ctx->entries[index].time = time;
+	ctx->entries[index].item = item;
+
+	return true;
+}
+
+const TIME_QUEUE_Entry_t *TIME_QUEUE_Peek(const TIME_QUEUE_Ctx_t *ctx)
+{
+	return (ctx->usage > 0) ? &ctx->entries[0] : NULL;
+}
+
+bool TIME_QUEUE_Pop(TIME_QUEUE_Ctx_t *ctx, TIME_QUEUE_Entry_t *entry)
+{
+	if (0 == ctx->usage)
+		return false;
+
+	/* Return root */
+	*entry = ctx->entries[0];
+
+	/* Sift last entry down from root, moving earlier children up until position found */
+	TIME_QUEUE_Entry_t last = ctx->entries[--ctx->usage];
+	uint32_t index = 0;
+	for (;;)
+	{
+		uint32_t child = (2 * index) + 1;
+		if (child >= ctx->usage)
+			break;
+
+		if (((child + 1) < ctx->usage) && (ctx->entries[child + 1].time < ctx->entries[child].time))
+			child++;
+
+		if (last.time <= ctx->entries[child].time)
+			break;
+
+		ctx->entries[index] = ctx->entries[child];
+		index = child;
+	}
+	ctx->entries[index] = last;
+
+	return true;
+}
@@ -0,0 +1,43 @@
+#ifndef __TIME_QUEUE_H__
+#define __TIME_QUEUE_H__
+
+/* Standard libraries */
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Type definitions - queue entry */
+typedef struct
+{
+	/* Time at which item is due */
+	uint64_t time;
+
+	/* Item */
+	void *item;
+
+} TIME_QUEUE_Entry_t;
+
+/* Type definitions - queue context (binary min-heap over caller provided entries) */
+typedef struct
+{
+	/* Entries */
+	TIME_QUEUE_Entry_t *entries;
+
+	/* Capacity / usage */
+	uint32_t capacity;
+	uint32_t usage;
+
+} TIME_QUEUE_Ctx_t;
+
+/* Public functions - init queue */
+void TIME_QUEUE_Init(TIME_QUEUE_Ctx_t *ctx, TIME_QUEUE_Entry_t *entries, uint32_t capacity);
+
+/* Add item due at time. Returns false if queue is full */
+bool TIME_QUEUE_Push(TIME_QUEUE_Ctx_t *ctx, uint64_t time, void *item);
+
+/* Retrieve earliest entry without removing it. Returns NULL if queue is empty */
+const TIME_QUEUE_Entry_t *TIME_QUEUE_Peek(const TIME_QUEUE_Ctx_t *ctx);
+
+/* Remove earliest entry. Returns false if queue is empty */
+bool TIME_QUEUE_Pop(TIME_QUEUE_Ctx_t *ctx, TIME_QUEUE_Entry_t *entry);
+
+#endif
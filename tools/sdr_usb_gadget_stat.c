@@ -0,0 +1,234 @@
+/* Standard / system libraries */
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Local modules */
+#include "metrics.h"
+
+/* Type definitions - copy of a thread's counters */
+typedef struct
+{
+	uint64_t bytes;
+	uint64_t buffers;
+	uint64_t overflows;
+	uint64_t underruns;
+	uint64_t late;
+	uint64_t lost;
+	uint64_t gaps;
+	uint64_t corrupt;
+	uint64_t aio_errors;
+	uint64_t shutdowns;
+
+} counters_t;
+
+/* Private functions */
+static void snapshot(const METRICS_Thread_t *src, counters_t *dest);
+static void print_counters(const char *name, const counters_t *curr, const counters_t *prev, unsigned int period);
+static void print_config(const char *name, const METRICS_Thread_t *metrics);
+static void print_usage(const char *program_name, FILE *dest);
+
+/* Public functions */
+int main(int argc, char *argv[])
+{
+	/* Long options array, mapping options to their short equivalents */
+	struct option long_options[] = {
+		{"watch", required_argument, NULL, 'w'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0} // Terminate the options array
+	};
+
+	/* Basic argument parsing */
+	int opt_c;
+	unsigned int period = 0;
+	while ((opt_c = getopt_long(argc, argv, "w:h", long_options, NULL)) != -1)
+	{
+			switch (opt_c)
+			{
+				case 'w':
+				{
+					period = (unsigned int)strtoul(optarg, NULL, 0);
+					break;
+				}
+				case 'h':
+				{
+					print_usage(argv[0], stdout);
+					return 0;
+				}
+				default:
+				{
+					print_usage(argv[0], stderr);
+					return 1;
+				}
+			}
+	}
+
+	/* Map metrics read only, such that the daemon is never perturbed */
+	int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		perror("Failed to open shared metrics (is the daemon running?)");
+		return 1;
+	}
+	const METRICS_Shared_t *metrics = mmap(NULL, sizeof(METRICS_Shared_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == metrics)
+	{
+		perror("Failed to map shared metrics");
+		return 1;
+	}
+
+	/* Check layout */
+	if (   (METRICS_MAGIC != metrics->magic)
+		|| (METRICS_VERSION != metrics->version)
+		|| (sizeof(METRICS_Shared_t) != metrics->size)
+	   )
+	{
+		fprintf(stderr, "Shared metrics layout mismatch (version %"PRIu32", expected %u)\n", metrics->version, METRICS_VERSION);
+		return 1;
+	}
+
+	/* Name threads of each interface (numbered only if there are several) */
+	uint32_t num_interfaces = (metrics->num_interfaces < SDR_USB_GADGET_MAX_INTERFACES) ? metrics->num_interfaces : SDR_USB_GADGET_MAX_INTERFACES;
+	char names[SDR_USB_GADGET_MAX_INTERFACES][2][16];
+	for (uint32_t i = 0; i < num_interfaces; i++)
+	{
+		if (1 == num_interfaces)
+		{
+			strcpy(names[i][0], "RX");
+			strcpy(names[i][1], "TX");
+		}
+		else
+		{
+			snprintf(names[i][0], sizeof(names[i][0]), "RX%"PRIu32, i);
+			snprintf(names[i][1], sizeof(names[i][1]), "TX%"PRIu32, i);
+		}
+	}
+
+	counters_t prev[SDR_USB_GADGET_MAX_INTERFACES][2], curr[SDR_USB_GADGET_MAX_INTERFACES][2];
+	for (uint32_t i = 0; i < num_interfaces; i++)
+	{
+		snapshot(&metrics->interfaces[i].rx, &curr[i][0]);
+		snapshot(&metrics->interfaces[i].tx, &curr[i][1]);
+	}
+
+	/* Print totals */
+	printf("PID: %"PRIu32"\n", metrics->pid);
+	for (uint32_t i = 0; i < num_interfaces; i++)
+	{
+		print_config(names[i][0], &metrics->interfaces[i].rx);
+		print_config(names[i][1], &metrics->interfaces[i].tx);
+	}
+	for (uint32_t i = 0; i < num_interfaces; i++)
+	{
+		print_counters(names[i][0], &curr[i][0], NULL, 0);
+		print_counters(names[i][1], &curr[i][1], NULL, 0);
+	}
+
+	/* Print rates until interrupted */
+	while (period > 0)
+	{
+		memcpy(prev, curr, sizeof(prev));
+		sleep(period);
+		for (uint32_t i = 0; i < num_interfaces; i++)
+		{
+			snapshot(&metrics->interfaces[i].rx, &curr[i][0]);
+			snapshot(&metrics->interfaces[i].tx, &curr[i][1]);
+			print_counters(names[i][0], &curr[i][0], &prev[i][0], period);
+			print_counters(names[i][1], &curr[i][1], &prev[i][1], period);
+		}
+	}
+
+	munmap((void*)metrics, sizeof(METRICS_Shared_t));
+
+	return 0;
+}
+
+/* Private functions */
+static void snapshot(const METRICS_Thread_t *src, counters_t *dest)
+{
+	dest->bytes = METRICS_Read(&src->bytes);
+	dest->buffers = METRICS_Read(&src->buffers);
+	dest->overflows = METRICS_Read(&src->overflows);
+	dest->underruns = METRICS_Read(&src->underruns);
+	dest->late = METRICS_Read(&src->late);
+	dest->lost = METRICS_Read(&src->lost);
+	dest->gaps = METRICS_Read(&src->gaps);
+	dest->corrupt = METRICS_Read(&src->corrupt);
+	dest->aio_errors = METRICS_Read(&src->aio_errors);
+	dest->shutdowns = METRICS_Read(&src->shutdowns);
+}
+
+static void print_counters(const char *name, const counters_t *curr, const counters_t *prev, unsigned int period)
+{
+	if (!prev)
+	{
+		/* Totals */
+		printf("%s: bytes: %"PRIu64", buffers: %"PRIu64", overflows: %"PRIu64", underruns: %"PRIu64", late: %"PRIu64", lost: %"PRIu64", gaps: %"PRIu64", corrupt: %"PRIu64", aio errors: %"PRIu64", shutdowns: %"PRIu64"\n",
+			   name,
+			   curr->bytes,
+			   curr->buffers,
+			   curr->overflows,
+			   curr->underruns,
+			   curr->late,
+			   curr->lost,
+			   curr->gaps,
+			   curr->corrupt,
+			   curr->aio_errors,
+			   curr->shutdowns
+		);
+	}
+	else
+	{
+		/* Rates / deltas over period */
+		printf("%s: %.2f MB/s, %"PRIu64" buffers/s, overflows: +%"PRIu64", underruns: +%"PRIu64", late: +%"PRIu64", lost: +%"PRIu64", gaps: +%"PRIu64", corrupt: +%"PRIu64", aio errors: +%"PRIu64", shutdowns: +%"PRIu64"\n",
+			   name,
+			   (double)(curr->bytes - prev->bytes) / period / 1e6,
+			   (curr->buffers - prev->buffers) / period,
+			   curr->overflows - prev->overflows,
+			   curr->underruns - prev->underruns,
+			   curr->late - prev->late,
+			   curr->lost - prev->lost,
+			   curr->gaps - prev->gaps,
+			   curr->corrupt - prev->corrupt,
+			   curr->aio_errors - prev->aio_errors,
+			   curr->shutdowns - prev->shutdowns
+		);
+	}
+}
+
+static void print_config(const char *name, const METRICS_Thread_t *metrics)
+{
+	static const char *const states[] =
+	{
+		[SDR_USB_GADGET_STREAM_STATE_STOPPED] = "stopped",
+		[SDR_USB_GADGET_STREAM_STATE_STARTING] = "starting",
+		[SDR_USB_GADGET_STREAM_STATE_RUNNING] = "running",
+		[SDR_USB_GADGET_STREAM_STATE_ERROR] = "error",
+	};
+
+	uint32_t state = atomic_load_explicit(&metrics->state, memory_order_acquire);
+	printf("%s: state: %s, channels: 0x%08"PRIx32", buffer size: %"PRIu32" samples / %"PRIu32" bytes, queue depth: %"PRIu32"\n",
+		   name,
+		   (state <= SDR_USB_GADGET_STREAM_STATE_ERROR) ? states[state] : "unknown",
+		   (uint32_t)atomic_load_explicit(&metrics->enabled_channels, memory_order_relaxed),
+		   (uint32_t)atomic_load_explicit(&metrics->buffer_size, memory_order_relaxed),
+		   (uint32_t)atomic_load_explicit(&metrics->usb_buffer_size, memory_order_relaxed),
+		   (uint32_t)atomic_load_explicit(&metrics->queue_depth, memory_order_relaxed)
+	);
+}
+
+static void print_usage(const char *program_name, FILE *dest)
+{
+	fprintf(dest, "Usage: %s [OPTIONS]\n", program_name);
+	fprintf(dest, "OPTIONS:\n");
+	fprintf(dest, "  -h, --help\t\tDisplay this help message\n");
+	fprintf(dest, "  -w, --watch SECS\tPrint rates every SECS seconds\n");
+}
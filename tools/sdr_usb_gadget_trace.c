@@ -0,0 +1,207 @@
+/* Standard / system libraries */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Local modules */
+#include "trace.h"
+#include "utils.h"
+
+/* Definitions */
+#define NS_PER_US (1000)
+#define NUM_SLOTS (4096)
+
+/* Type definitions - direction being analysed */
+typedef struct
+{
+	/* Name of direction */
+	const char *name;
+
+	/* First / last stage of direction */
+	TRACE_Stage_t first;
+	TRACE_Stage_t last;
+
+	/* Buffers in flight, indexed by sequence number */
+	struct
+	{
+		uint32_t sequence;
+		uint32_t seen;
+		uint64_t time[TRACE_STAGE_COUNT];
+	} slots[NUM_SLOTS];
+
+	/* Latency from previous stage to each stage, and first to last stage */
+	UTILS_Histogram_t stage_latency[TRACE_STAGE_COUNT];
+	UTILS_Histogram_t total_latency;
+
+	/* Buffers seen which never reached the last stage */
+	uint64_t incomplete;
+
+} direction_t;
+
+/* Private functions */
+static void process_record(direction_t *dir, const TRACE_Record_t *record);
+static void print_direction(const direction_t *dir);
+
+/* Private variables */
+static const char *const stage_names[TRACE_STAGE_COUNT] =
+{
+	[TRACE_STAGE_RX_REFILL] = "refill",
+	[TRACE_STAGE_RX_COPY] = "copy",
+	[TRACE_STAGE_RX_SUBMIT] = "io_submit",
+	[TRACE_STAGE_RX_COMPLETE] = "usb complete",
+	[TRACE_STAGE_TX_COMPLETE] = "usb complete",
+	[TRACE_STAGE_TX_COPY] = "copy",
+	[TRACE_STAGE_TX_PUSH] = "push",
+};
+
+/* Public functions */
+int main(int argc, char *argv[])
+{
+	if ((argc < 2) || (argc > 3))
+	{
+		fprintf(stderr, "Usage: %s TRACE_FILE [INTERFACE]\n", argv[0]);
+		return 1;
+	}
+
+	/* Analyse a single interface's threads (default first) */
+	unsigned long interface = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0;
+
+	/* Open trace */
+	FILE *file = fopen(argv[1], "rb");
+	if (!file)
+	{
+		perror("Failed to open trace file");
+		return 1;
+	}
+
+	/* Check header */
+	TRACE_FileHeader_t header;
+	if (   (1 != fread(&header, sizeof(header), 1, file))
+		|| (TRACE_FILE_MAGIC != header.magic)
+		|| (TRACE_FILE_VERSION != header.version)
+	   )
+	{
+		fprintf(stderr, "Not a version %u trace file\n", TRACE_FILE_VERSION);
+		fclose(file);
+		return 1;
+	}
+
+	/* Prepare directions */
+	direction_t *rx = calloc(1, sizeof(direction_t));
+	direction_t *tx = calloc(1, sizeof(direction_t));
+	if (!rx || !tx)
+	{
+		perror("Failed to allocate state");
+		fclose(file);
+		return 1;
+	}
+	rx->name = "RX";
+	rx->first = TRACE_STAGE_RX_REFILL;
+	rx->last = TRACE_STAGE_RX_COMPLETE;
+	tx->name = "TX";
+	tx->first = TRACE_STAGE_TX_COMPLETE;
+	tx->last = TRACE_STAGE_TX_PUSH;
+	for (unsigned int i = 0; i < TRACE_STAGE_COUNT; i++)
+	{
+		UTILS_ResetHistogram(&rx->stage_latency[i]);
+		UTILS_ResetHistogram(&tx->stage_latency[i]);
+	}
+	UTILS_ResetHistogram(&rx->total_latency);
+	UTILS_ResetHistogram(&tx->total_latency);
+
+	/* Process records (stored in order per thread) */
+	TRACE_Record_t record;
+	uint32_t count = 0;
+	while (1 == fread(&record, sizeof(record), 1, file))
+	{
+		if (interface != record.interface)
+		{
+			/* Skip other interfaces */
+		}
+		else if (record.stage <= TRACE_STAGE_RX_COMPLETE)
+		{
+			process_record(rx, &record);
+		}
+		else if (record.stage < TRACE_STAGE_COUNT)
+		{
+			process_record(tx, &record);
+		}
+		count++;
+	}
+	fclose(file);
+
+	if (count != header.record_count)
+	{
+		fprintf(stderr, "Warning: header reports %"PRIu32" records, read %"PRIu32"\n", header.record_count, count);
+	}
+
+	/* Report */
+	printf("Records: %"PRIu32", interface: %lu\n", count, interface);
+	print_direction(rx);
+	print_direction(tx);
+
+	free(rx);
+	free(tx);
+
+	return 0;
+}
+
+/* Private functions */
+static void process_record(direction_t *dir, const TRACE_Record_t *record)
+{
+	/* Locate slot */
+	TRACE_Stage_t stage = (TRACE_Stage_t)record->stage;
+	__typeof__(dir->slots[0]) *slot = &dir->slots[record->sequence % NUM_SLOTS];
+
+	if (dir->first == stage)
+	{
+		/* New buffer, count any previous occupant which didn't complete */
+		if (slot->seen && !(slot->seen & (1U << dir->last)))
+		{
+			dir->incomplete++;
+		}
+		memset(slot, 0x00, sizeof(*slot));
+		slot->sequence = record->sequence;
+	}
+	else if ((slot->sequence != record->sequence) || !(slot->seen & (1U << dir->first)))
+	{
+		/* Buffer started before the trace did */
+		return;
+	}
+
+	/* Record time */
+	slot->time[stage] = record->time;
+	slot->seen |= (1U << stage);
+
+	if (dir->last == stage)
+	{
+		/* Buffer completed, record latency between each pair of stages seen */
+		unsigned int prev = dir->first;
+		for (unsigned int i = dir->first + 1; i <= dir->last; i++)
+		{
+			if (slot->seen & (1U << i))
+			{
+				UTILS_RecordHistogram(&dir->stage_latency[i], (slot->time[i] - slot->time[prev]) / NS_PER_US);
+				prev = i;
+			}
+		}
+		UTILS_RecordHistogram(&dir->total_latency, (slot->time[dir->last] - slot->time[dir->first]) / NS_PER_US);
+	}
+}
+
+static void print_direction(const direction_t *dir)
+{
+	char name[64];
+
+	printf("%s:\n", dir->name);
+	for (unsigned int i = dir->first + 1; i <= dir->last; i++)
+	{
+		snprintf(name, sizeof(name), "  -> %s", stage_names[i]);
+		UTILS_PrintHistogram(name, &dir->stage_latency[i]);
+	}
+	snprintf(name, sizeof(name), "  %s -> %s", stage_names[dir->first], stage_names[dir->last]);
+	UTILS_PrintHistogram(name, &dir->total_latency);
+	printf("  Incomplete buffers (dropped or in flight): %"PRIu64"\n", dir->incomplete);
+}
@@ -0,0 +1,119 @@
+/* Public header file */
+#include "trace.h"
+
+/* Standard / system libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Public functions */
+bool TRACE_Init(TRACE_Ring_t *ring, uint32_t capacity, uint8_t interface)
+{
+	/* Reset ring */
+	memset(ring, 0x00, sizeof(*ring));
+	ring->interface = interface;
+
+	/* Round capacity up to power of two, such that head can be masked rather than wrapped */
+	uint32_t rounded = 1;
+	while ((rounded < capacity) && (rounded < (1U << 31))) rounded <<= 1;
+
+	/* Allocate records */
+	ring->records = calloc(rounded, sizeof(TRACE_Record_t));
+	if (!ring->records)
+	{
+		perror("Failed to allocate trace ring");
+		return false;
+	}
+	ring->capacity = rounded;
+
+	return true;
+}
+
+void TRACE_Deinit(TRACE_Ring_t *ring)
+{
+	/* Free records */
+	free(ring->records);
+	ring->records = NULL;
+	ring->capacity = 0;
+}
+
+bool TRACE_Dump(const char *path, TRACE_Ring_t *rings[], unsigned int count)
+{
+	TRACE_FileHeader_t header =
+	{
+		.magic = TRACE_FILE_MAGIC,
+		.version = TRACE_FILE_VERSION,
+	};
+
+	/* Open file */
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		perror("Failed to open trace file");
+		return false;
+	}
+
+	/* Write placeholder header, updated with record count once known */
+	bool ok = (1 == fwrite(&header, sizeof(header), 1, file));
+
+	for (unsigned int i = 0; ok && (i < count); i++)
+	{
+		TRACE_Ring_t *ring = rings[i];
+
+		/* Skip disabled rings */
+		if (!ring || !ring->records)
+			continue;
+
+		/* Take a copy of the ring, such that the writer isn't held up */
+		TRACE_Record_t *copy = malloc(ring->capacity * sizeof(TRACE_Record_t));
+		if (!copy)
+		{
+			perror("Failed to allocate trace copy");
+			ok = false;
+			break;
+		}
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		uint32_t available = (head < ring->capacity) ? head : ring->capacity;
+		uint32_t start = head - available;
+		for (uint32_t j = 0; j < available; j++)
+		{
+			copy[j] = ring->records[(start + j) & (ring->capacity - 1)];
+		}
+
+		/* Discard the oldest records, which the writer may have overwritten while copying */
+		uint32_t overwritten = atomic_load_explicit(&ring->head, memory_order_acquire) - head;
+		if (available == ring->capacity)
+		{
+			/* Once full, the unpublished record being written reuses the slot of the oldest one not yet overwritten */
+			overwritten++;
+		}
+		uint32_t skip = (overwritten < available) ? overwritten : available;
+
+		/* Write records */
+		if ((available - skip) != fwrite(&copy[skip], sizeof(TRACE_Record_t), available - skip, file))
+		{
+			ok = false;
+		}
+		header.record_count += available - skip;
+		free(copy);
+	}
+
+	/* Update header */
+	if (ok)
+	{
+		ok = (0 == fseek(file, 0, SEEK_SET)) && (1 == fwrite(&header, sizeof(header), 1, file));
+	}
+	if (0 != fclose(file))
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write trace file %s\n", path);
+		return false;
+	}
+
+	printf("Wrote %u trace records to %s\n", header.record_count, path);
+
+	return true;
+}
@@ -0,0 +1,119 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Standard libraries */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Definitions */
+#define TRACE_FILE_MAGIC (0x52544453) /* "SDTR" */
+#define TRACE_FILE_VERSION (1)
+#define TRACE_NO_BUFFER (UINT16_MAX)
+
+/* Type definitions - buffer lifecycle stages */
+typedef enum
+{
+	/* RX - iio_buffer_refill() returned */
+	TRACE_STAGE_RX_REFILL = 0,
+
+	/* RX - samples copied into USB buffer */
+	TRACE_STAGE_RX_COPY,
+
+	/* RX - io_submit() returned */
+	TRACE_STAGE_RX_SUBMIT,
+
+	/* RX - USB write completion reaped */
+	TRACE_STAGE_RX_COMPLETE,
+
+	/* TX - USB read completion reaped */
+	TRACE_STAGE_TX_COMPLETE,
+
+	/* TX - samples copied into IIO buffer */
+	TRACE_STAGE_TX_COPY,
+
+	/* TX - iio_buffer_push() returned */
+	TRACE_STAGE_TX_PUSH,
+
+	/* Number of stages */
+	TRACE_STAGE_COUNT
+
+} TRACE_Stage_t;
+
+/* Type definitions - file layout (header followed by records) */
+#pragma pack(push,1)
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_count;
+	uint32_t reserved;
+
+} TRACE_FileHeader_t;
+
+typedef struct
+{
+	/* Monotonic time (nS) */
+	uint64_t time;
+
+	/* Buffer sequence number (per thread start) */
+	uint32_t sequence;
+
+	/* Index of USB buffer within thread's pool */
+	uint16_t buffer;
+
+	/* Stage (TRACE_Stage_t) */
+	uint8_t stage;
+
+	/* Interface of thread */
+	uint8_t interface;
+
+} TRACE_Record_t;
+#pragma pack(pop)
+
+/* Type definitions - ring, written by a single thread */
+typedef struct
+{
+	/* Records, capacity is a power of two */
+	TRACE_Record_t *records;
+	uint32_t capacity;
+
+	/* Total records written (wrapping) */
+	atomic_uint_least32_t head;
+
+	/* Interface of writing thread, stored in each record */
+	uint8_t interface;
+
+} TRACE_Ring_t;
+
+/* Allocate ring with at least the given number of records, for a thread of the given interface */
+bool TRACE_Init(TRACE_Ring_t *ring, uint32_t capacity, uint8_t interface);
+
+/* Free ring */
+void TRACE_Deinit(TRACE_Ring_t *ring);
+
+/* Write the contents of rings to file (safe to call while rings are being written) */
+bool TRACE_Dump(const char *path, TRACE_Ring_t *rings[], unsigned int count);
+
+/* Record stage of buffer, ring may be NULL if tracing is disabled */
+static inline void TRACE_Record(TRACE_Ring_t *ring, TRACE_Stage_t stage, uint16_t buffer, uint32_t sequence)
+{
+	if (!ring)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	/* Fill next record, publishing it by advancing head */
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	TRACE_Record_t *record = &ring->records[head & (ring->capacity - 1)];
+	record->time = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+	record->sequence = sequence;
+	record->buffer = buffer;
+	record->stage = (uint8_t)stage;
+	record->interface = ring->interface;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define __USB_BUFF_H__
 
 /* Standard libraries */
+#include <stdbool.h>
 #include <stdint.h>
 
 /* AsyncIO library */
@@ -16,6 +17,15 @@ typedef struct
 	/* Buffer in use - command queued */
 	bool in_use;
 
+	/* Index within thread's buffer pool */
+	uint16_t index;
+
+	/* Sequence number of data held (for tracing) */
+	uint32_t sequence;
+
+	/* Time request was submitted (uS, only maintained when generating stats) */
+	uint64_t submit_time;
+
 	/* Data buffer follows */
 	uint8_t data[];
 
@@ -3,10 +3,15 @@
 
 /* Standard / system libraries */
 #include <byteswap.h>
+#include <glob.h>
 #include <linux/usb/functionfs.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
 /* Macros */
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 	#define htole16(x) (x)
@@ -17,80 +22,28 @@
 #endif
 
 /* Definitions */
+#define MAX_BULK_TRANSFER_FS (64)
 #define MAX_BULK_TRANSFER_HS (512)
+#define MAX_BULK_TRANSFER_SS (1024)
+#define MAX_INT_TRANSFER (sizeof(cmd_usb_event_t))
+#define MAX_ISO_TRANSFER_FS (1023)
+#define MAX_ISO_TRANSFER_HS (1024) /* Per packet, up to three packets per microframe */
+#define INT_INTERVAL_FS (1) /* Frames (1ms) */
+#define INT_INTERVAL_HS (4) /* 2^(n-1) microframes (1ms) */
+#define INT_INTERVAL_SS (4) /* 2^(n-1) bus intervals (1ms) */
+#define ISO_INTERVAL (1) /* Every frame / microframe / bus interval */
+#define MAX_DESCRIPTORS_SIZE (512)
 #define INTERFACE_NAME "sdrgadget"
+#define UDC_SPEED_GLOB "/sys/class/udc/*/current_speed"
+
+/* Private functions */
+static uint32_t append_descriptors(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config);
+static uint32_t append_interface(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config, uint8_t interface);
+static uint32_t append_endpoint(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config, uint8_t address, uint8_t attributes);
+static void append(uint8_t **ptr, const void *data, size_t length);
 
 /* Private variables */
-static const struct
-{
-	struct usb_functionfs_descs_head_v2 header;
-	__le32 fs_count;
-	__le32 hs_count;
-	struct
-	{
-		struct usb_interface_descriptor intf;
-		struct usb_endpoint_descriptor_no_audio bulk_sink;
-		struct usb_endpoint_descriptor_no_audio bulk_source;
-	} __attribute__ ((__packed__)) fs_descs, hs_descs;
-} __attribute__ ((__packed__)) usb_descriptors =
-{
-	.header =
-	{
-		.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
-		.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
-		.length = htole32(sizeof(usb_descriptors)),
-	},
-	.fs_count = htole32(3),
-	.fs_descs = {
-		.intf = {
-			.bLength = sizeof(usb_descriptors.fs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
-			.iInterface = 1,
-		},
-		.bulk_sink = {
-			.bLength = sizeof(usb_descriptors.fs_descs.bulk_sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-		},
-		.bulk_source = {
-			.bLength = sizeof(usb_descriptors.fs_descs.bulk_source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-		},
-	},
-	.hs_count = htole32(3),
-	.hs_descs =
-	{
-		.intf =
-		{
-			.bLength = sizeof(usb_descriptors.hs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
-			.iInterface = 1,
-		},
-		.bulk_sink =
-		{
-			.bLength = sizeof(usb_descriptors.hs_descs.bulk_sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = htole16(MAX_BULK_TRANSFER_HS),
-		},
-		.bulk_source =
-		{
-			.bLength = sizeof(usb_descriptors.hs_descs.bulk_source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = htole16(MAX_BULK_TRANSFER_HS),
-		},
-	},
-};
+static USB_DESCRIPTORS_Config_t descriptors_config;
 
 static const struct
 {
@@ -117,10 +70,36 @@ static const struct
 };
 
 /* Public functions */
-bool USB_DESCRIPTORS_WriteToEP0(int fd)
+bool USB_DESCRIPTORS_WriteToEP0(int fd, const USB_DESCRIPTORS_Config_t *config)
 {
+	uint8_t descriptors[MAX_DESCRIPTORS_SIZE];
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 counts[3];
+	unsigned int num_speeds = config->superspeed ? 3 : 2;
+
+	/* Store configuration, for max packet size lookup */
+	descriptors_config = *config;
+
+	/* Generate descriptor sets for each speed, following header and counts */
+	uint8_t *ptr = descriptors + sizeof(header) + (num_speeds * sizeof(counts[0]));
+	counts[0] = htole32(append_descriptors(&ptr, USB_SPEED_FULL, config));
+	counts[1] = htole32(append_descriptors(&ptr, USB_SPEED_HIGH, config));
+	if (config->superspeed)
+	{
+		counts[2] = htole32(append_descriptors(&ptr, USB_SPEED_SUPER, config));
+	}
+
+	/* Fill header and counts */
+	size_t length = ptr - descriptors;
+	header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+	header.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | (config->superspeed ? FUNCTIONFS_HAS_SS_DESC : 0));
+	header.length = htole32(length);
+	ptr = descriptors;
+	append(&ptr, &header, sizeof(header));
+	append(&ptr, counts, num_speeds * sizeof(counts[0]));
+
 	/* Write descriptors */
-	if (write(fd, &usb_descriptors, sizeof(usb_descriptors)) < 0)
+	if (write(fd, descriptors, length) < 0)
 	{
 		perror("Failed to write descriptors");
 		return false;
@@ -135,3 +114,227 @@ bool USB_DESCRIPTORS_WriteToEP0(int fd)
 
 	return true;
 }
+
+uint32_t USB_DESCRIPTORS_GetSpeed(void)
+{
+	static const struct
+	{
+		const char *name;
+		enum usb_device_speed speed;
+	} speeds[] =
+	{
+		{ "full-speed", USB_SPEED_FULL },
+		{ "high-speed", USB_SPEED_HIGH },
+		{ "super-speed", USB_SPEED_SUPER },
+		{ "super-speed-plus", USB_SPEED_SUPER_PLUS },
+	};
+	enum usb_device_speed speed = USB_SPEED_UNKNOWN;
+
+	/* Search UDCs for one which is connected (the gadget is normally bound to the only UDC) */
+	glob_t matches;
+	if (0 != glob(UDC_SPEED_GLOB, 0, NULL, &matches))
+		return speed;
+
+	for (size_t i = 0; (i < matches.gl_pathc) && (USB_SPEED_UNKNOWN == speed); i++)
+	{
+		char value[32] = "";
+		FILE *file = fopen(matches.gl_pathv[i], "r");
+		if (!file)
+			continue;
+
+		if (fgets(value, sizeof(value), file))
+		{
+			value[strcspn(value, "\n")] = '\0';
+			for (size_t j = 0; j < sizeof(speeds) / sizeof(speeds[0]); j++)
+			{
+				if (0 == strcmp(value, speeds[j].name))
+				{
+					speed = speeds[j].speed;
+					break;
+				}
+			}
+		}
+		fclose(file);
+	}
+	globfree(&matches);
+
+	return speed;
+}
+
+unsigned int USB_DESCRIPTORS_GetBulkEndpoint(unsigned int interface, bool out)
+{
+	/* First interface's pair precedes the interrupt endpoint, further pairs follow it */
+	unsigned int in = (0 == interface) ? 1 : (2 + (2 * interface));
+
+	return out ? (in + 1) : in;
+}
+
+uint16_t USB_DESCRIPTORS_GetBulkMaxPacketSize(uint32_t speed)
+{
+	/* Without SuperSpeed descriptors, the function operates with high speed descriptors */
+	if ((speed >= USB_SPEED_SUPER) && descriptors_config.superspeed)
+	{
+		return MAX_BULK_TRANSFER_SS;
+	}
+	else if (speed >= USB_SPEED_HIGH)
+	{
+		return MAX_BULK_TRANSFER_HS;
+	}
+
+	return MAX_BULK_TRANSFER_FS;
+}
+
+bool USB_DESCRIPTORS_IsIsochronous(uint32_t speed, unsigned int interface)
+{
+	/* Only the first interface's data endpoints, and not at full speed */
+	return (0 == interface) && (descriptors_config.iso_mult > 0) && (speed >= USB_SPEED_HIGH);
+}
+
+uint32_t USB_DESCRIPTORS_GetIsoBytesPerInterval(uint32_t speed)
+{
+	if (speed >= USB_SPEED_HIGH)
+	{
+		return MAX_ISO_TRANSFER_HS * descriptors_config.iso_mult;
+	}
+
+	return MAX_ISO_TRANSFER_FS;
+}
+
+uint32_t USB_DESCRIPTORS_GetIsoIntervalMicros(uint32_t speed)
+{
+	/* Serviced every microframe / bus interval, or every frame at full speed */
+	return (speed >= USB_SPEED_HIGH) ? (125 * ISO_INTERVAL) : (1000 * ISO_INTERVAL);
+}
+
+/* Private functions */
+static uint32_t append_descriptors(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config)
+{
+	uint32_t count = 0;
+
+	for (uint8_t i = 0; i < config->num_interfaces; i++)
+	{
+		count += append_interface(ptr, speed, config, i);
+	}
+
+	return count;
+}
+
+static uint32_t append_interface(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config, uint8_t interface)
+{
+	uint32_t count = 0;
+
+	/* Full speed can't fit isochronous IN and OUT packets of 1023 bytes in a frame's periodic budget, so stays bulk */
+	bool isochronous = (0 == interface) && (config->iso_mult > 0) && (speed >= USB_SPEED_HIGH);
+
+	/* Isochronous endpoints reserve bandwidth, so must sit in a non-default alternate setting, behind one without endpoints */
+	if (isochronous)
+	{
+		struct usb_interface_descriptor alt0 =
+		{
+			.bLength = sizeof(alt0),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bInterfaceNumber = interface,
+			.bAlternateSetting = 0,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		};
+		append(ptr, &alt0, sizeof(alt0));
+		count++;
+	}
+
+	/* Interface, the first carrying the interrupt endpoint */
+	struct usb_interface_descriptor intf =
+	{
+		.bLength = sizeof(intf),
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = interface,
+		.bAlternateSetting = isochronous ? 1 : 0,
+		.bNumEndpoints = (0 == interface) ? 3 : 2,
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+		.iInterface = 1,
+	};
+	append(ptr, &intf, sizeof(intf));
+	count++;
+
+	/* Bulk (or isochronous) in (RX), out (TX) and interrupt in (events) endpoints */
+	uint8_t data_attributes = USB_ENDPOINT_XFER_BULK;
+	if (isochronous)
+	{
+		data_attributes = USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_ASYNC;
+	}
+	count += append_endpoint(ptr, speed, config, USB_DESCRIPTORS_GetBulkEndpoint(interface, false) | USB_DIR_IN, data_attributes);
+	count += append_endpoint(ptr, speed, config, USB_DESCRIPTORS_GetBulkEndpoint(interface, true) | USB_DIR_OUT, data_attributes);
+	if (0 == interface)
+	{
+		count += append_endpoint(ptr, speed, config, USB_DESCRIPTORS_EVENT_ENDPOINT | USB_DIR_IN, USB_ENDPOINT_XFER_INT);
+	}
+
+	return count;
+}
+
+static uint32_t append_endpoint(uint8_t **ptr, enum usb_device_speed speed, const USB_DESCRIPTORS_Config_t *config, uint8_t address, uint8_t attributes)
+{
+	uint8_t type = attributes & USB_ENDPOINT_XFERTYPE_MASK;
+
+	/* Endpoint */
+	struct usb_endpoint_descriptor_no_audio ep =
+	{
+		.bLength = sizeof(ep),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = address,
+		.bmAttributes = attributes,
+	};
+	if (USB_ENDPOINT_XFER_INT == type)
+	{
+		ep.wMaxPacketSize = htole16(MAX_INT_TRANSFER);
+		ep.bInterval = (USB_SPEED_FULL == speed) ? INT_INTERVAL_FS : ((USB_SPEED_HIGH == speed) ? INT_INTERVAL_HS : INT_INTERVAL_SS);
+	}
+	else if (USB_ENDPOINT_XFER_ISOC == type)
+	{
+		/* High speed packs additional transactions per microframe into bits 12:11, SuperSpeed bursts instead */
+		ep.wMaxPacketSize = htole16((USB_SPEED_FULL == speed) ? MAX_ISO_TRANSFER_FS : MAX_ISO_TRANSFER_HS);
+		if (USB_SPEED_HIGH == speed)
+		{
+			ep.wMaxPacketSize |= htole16((config->iso_mult - 1) << 11);
+		}
+		ep.bInterval = ISO_INTERVAL;
+	}
+	else
+	{
+		ep.wMaxPacketSize = htole16((USB_SPEED_FULL == speed) ? MAX_BULK_TRANSFER_FS : ((USB_SPEED_HIGH == speed) ? MAX_BULK_TRANSFER_HS : MAX_BULK_TRANSFER_SS));
+	}
+	append(ptr, &ep, sizeof(ep));
+	if (speed < USB_SPEED_SUPER)
+		return 1;
+
+	/* SuperSpeed endpoint companion, bulk endpoints bursting / advertising streams as configured */
+	struct usb_ss_ep_comp_descriptor comp =
+	{
+		.bLength = USB_DT_SS_EP_COMP_SIZE,
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+	};
+	if (USB_ENDPOINT_XFER_INT == type)
+	{
+		comp.wBytesPerInterval = htole16(MAX_INT_TRANSFER);
+	}
+	else if (USB_ENDPOINT_XFER_ISOC == type)
+	{
+		comp.bMaxBurst = config->iso_mult - 1;
+		comp.wBytesPerInterval = htole16(MAX_ISO_TRANSFER_HS * config->iso_mult);
+	}
+	else
+	{
+		comp.bMaxBurst = config->max_burst;
+		comp.bmAttributes = config->max_streams;
+	}
+	append(ptr, &comp, sizeof(comp));
+
+	return 2;
+}
+
+static void append(uint8_t **ptr, const void *data, size_t length)
+{
+	memcpy(*ptr, data, length);
+	*ptr += length;
+}
@@ -3,8 +3,57 @@
 
 /* Standard libraries */
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Local modules */
+#include "sdr_usb_gadget_types.h"
+
+/*
+** Definitions - endpoint numbers (FunctionFS epN files, matching endpoint addresses)
+** Interface 0 provides ep1 (bulk in), ep2 (bulk out) and ep3 (interrupt in), further interfaces a bulk in / out pair each.
+*/
+#define USB_DESCRIPTORS_EVENT_ENDPOINT (3)
+#define USB_DESCRIPTORS_MAX_ENDPOINTS (2 + (2 * SDR_USB_GADGET_MAX_INTERFACES)) /* Including ep0 */
+
+/* Type definitions - descriptor configuration */
+typedef struct
+{
+	/* Provide SuperSpeed descriptors */
+	bool superspeed;
+
+	/* Bulk endpoint burst size (SuperSpeed, packets - 1, 0 - 15) */
+	uint8_t max_burst;
+
+	/* Bulk endpoint streams advertised (SuperSpeed, log2, 0 - 16) */
+	uint8_t max_streams;
+
+	/* Number of interfaces (1 - SDR_USB_GADGET_MAX_INTERFACES) */
+	uint8_t num_interfaces;
+
+	/* First interface's data endpoints isochronous, with this many packets per (micro)frame (1 - 3), zero for bulk */
+	uint8_t iso_mult;
+
+} USB_DESCRIPTORS_Config_t;
 
 /* Public functions */
-bool USB_DESCRIPTORS_WriteToEP0(int fd);
+bool USB_DESCRIPTORS_WriteToEP0(int fd, const USB_DESCRIPTORS_Config_t *config);
+
+/* Retrieve speed negotiated by UDC (enum usb_device_speed), USB_SPEED_UNKNOWN if not connected */
+uint32_t USB_DESCRIPTORS_GetSpeed(void);
+
+/* Retrieve number of endpoint of interface's bulk in (RX) / out (TX) endpoint */
+unsigned int USB_DESCRIPTORS_GetBulkEndpoint(unsigned int interface, bool out);
+
+/* Retrieve bulk endpoint max packet size for speed, given descriptors written */
+uint16_t USB_DESCRIPTORS_GetBulkMaxPacketSize(uint32_t speed);
+
+/* Check whether an interface's data endpoints are isochronous at speed (in alternate setting 1), given descriptors written */
+bool USB_DESCRIPTORS_IsIsochronous(uint32_t speed, unsigned int interface);
+
+/* Retrieve isochronous endpoint bytes per (micro)frame for speed, given descriptors written */
+uint32_t USB_DESCRIPTORS_GetIsoBytesPerInterval(uint32_t speed);
+
+/* Retrieve isochronous endpoint service interval for speed (microseconds) */
+uint32_t USB_DESCRIPTORS_GetIsoIntervalMicros(uint32_t speed);
 
 #endif
@@ -6,6 +6,7 @@
 
 /* Standard libraries */
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,39 +17,31 @@
 #define NS_PER_US (1000)
 
 /* Private functions */
-static uint64_t GetMonotonicMicros(void);
+static uint32_t HistogramBucket(uint64_t value);
+static uint64_t HistogramBucketUpper(uint32_t bucket);
 
 /* Public functions */
-void UTILS_ResetTimeStats(UTILS_TimeStats_t *ctx)
+void UTILS_ResetHistogram(UTILS_Histogram_t *ctx)
 {
     /* Zero structure */
     memset(ctx, 0x00, sizeof(*ctx));
-
-    /* Pre-set min */
-    ctx->min = UINT64_MAX;
 }
 
-void UTILS_StartTimeStats(UTILS_TimeStats_t *ctx)
+void UTILS_StartHistogram(UTILS_Histogram_t *ctx)
 {
     /* Set last timestamp and flag initialized */
-    ctx->last_time = GetMonotonicMicros();
+    ctx->last_time = UTILS_GetMonotonicMicros();
     ctx->initialized = true;
 }
 
-void UTILS_UpdateTimeStats(UTILS_TimeStats_t *ctx)
+void UTILS_UpdateHistogram(UTILS_Histogram_t *ctx)
 {
-    uint64_t curr_time = GetMonotonicMicros();
+    uint64_t curr_time = UTILS_GetMonotonicMicros();
 
     if (ctx->initialized)
     {
-        /* Calculate time difference */
-        uint64_t diff = curr_time - ctx->last_time;
-
-        /* Update stats */
-        ctx->total += diff;
-        ctx->count++;
-        if (diff < ctx->min) ctx->min = diff;
-        if (diff > ctx->max) ctx->max = diff;
+        /* Record time difference */
+        UTILS_RecordHistogram(ctx, curr_time - ctx->last_time);
     }
 
     /* Set last timestamp and flag initialized */
@@ -56,9 +49,63 @@ void UTILS_UpdateTimeStats(UTILS_TimeStats_t *ctx)
     ctx->initialized = true;
 }
 
-uint64_t UTILS_CalcAverageTimeStats(UTILS_TimeStats_t *ctx)
+void UTILS_RecordHistogram(UTILS_Histogram_t *ctx, uint64_t value)
 {
-    return ctx->total / ctx->count;
+    /* Update stats */
+    ctx->buckets[HistogramBucket(value)]++;
+    ctx->count++;
+    if (value > ctx->max) ctx->max = value;
+}
+
+uint64_t UTILS_CalcPercentileHistogram(const UTILS_Histogram_t *ctx, double percentile)
+{
+    if (0 == ctx->count)
+        return 0;
+
+    /* Calculate rank of sample at percentile (rounding up, minimum of first sample) */
+    uint64_t rank = (uint64_t)((percentile / 100.0) * (double)ctx->count + 0.999999);
+    if (rank < 1) rank = 1;
+
+    /* Walk buckets until rank reached */
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < UTILS_HISTOGRAM_BUCKETS; i++)
+    {
+        total += ctx->buckets[i];
+        if (total >= rank)
+        {
+            /* Bucket bound may exceed largest value seen */
+            uint64_t upper = HistogramBucketUpper(i);
+            return (upper < ctx->max) ? upper : ctx->max;
+        }
+    }
+
+    return ctx->max;
+}
+
+void UTILS_PrintHistogram(const char *name, const UTILS_Histogram_t *ctx)
+{
+    printf("%s: p50: %"PRIu64", p99: %"PRIu64", p99.9: %"PRIu64", max: %"PRIu64", count: %"PRIu64" (uS)\n",
+           name,
+           UTILS_CalcPercentileHistogram(ctx, 50.0),
+           UTILS_CalcPercentileHistogram(ctx, 99.0),
+           UTILS_CalcPercentileHistogram(ctx, 99.9),
+           ctx->max,
+           ctx->count
+    );
+}
+
+uint64_t UTILS_GetMonotonicMicros(void)
+{
+    struct timespec tmp_time;
+
+    if (0 != clock_gettime(CLOCK_MONOTONIC_RAW, &tmp_time))
+    {
+        /* Failed to query clock */
+        return 0;
+    }
+
+    /* Convert seconds + nanoseconds to us */
+    return (((uint64_t)tmp_time.tv_sec * US_PER_SEC) + ((uint64_t)tmp_time.tv_nsec / NS_PER_US));
 }
 
 int UTILS_SetThreadRealtimePriority(void)
@@ -103,16 +150,28 @@ int UTILS_SetThreadAffinity(int cpu_id)
 }
 
 /* Private functions */
-static uint64_t GetMonotonicMicros(void)
+static uint32_t HistogramBucket(uint64_t value)
 {
-    struct timespec tmp_time;
+    /* Clamp to largest representable value */
+    if (value > UTILS_HISTOGRAM_MAX_VALUE) value = UTILS_HISTOGRAM_MAX_VALUE;
 
-    if (0 != clock_gettime(CLOCK_MONOTONIC_RAW, &tmp_time))
-    {
-        /* Failed to query clock */
-        return 0;
-    }
+    /* Small values map directly to the first set of sub-buckets */
+    if (value < UTILS_HISTOGRAM_SUB_BUCKETS)
+        return (uint32_t)value;
 
-    /* Convert seconds + nanoseconds to us */
-    return (((uint64_t)tmp_time.tv_sec * US_PER_SEC) + ((uint64_t)tmp_time.tv_nsec / NS_PER_US));
+    /* Shift value such that it has SUB_BUCKET_BITS + 1 significant bits, the lower bits selecting the sub-bucket */
+    uint32_t shift = (63 - __builtin_clzll(value)) - UTILS_HISTOGRAM_SUB_BUCKET_BITS;
+    return ((shift + 1) << UTILS_HISTOGRAM_SUB_BUCKET_BITS) + (uint32_t)((value >> shift) - UTILS_HISTOGRAM_SUB_BUCKETS);
+}
+
+static uint64_t HistogramBucketUpper(uint32_t bucket)
+{
+    /* Small values map directly */
+    if (bucket < UTILS_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    /* Reverse mapping performed above */
+    uint32_t shift = (bucket >> UTILS_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    uint64_t sub = bucket & (UTILS_HISTOGRAM_SUB_BUCKETS - 1);
+    return ((UTILS_HISTOGRAM_SUB_BUCKETS + sub) << shift) + ((UINT64_C(1) << shift) - 1);
 }
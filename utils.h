@@ -5,7 +5,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/* Stats */
+/* Histogram layout, values are bucketed by magnitude (power of two) with linear sub-buckets within each magnitude */
+#define UTILS_HISTOGRAM_SUB_BUCKET_BITS (4)
+#define UTILS_HISTOGRAM_SUB_BUCKETS (1U << UTILS_HISTOGRAM_SUB_BUCKET_BITS)
+#define UTILS_HISTOGRAM_MAGNITUDES (28)
+#define UTILS_HISTOGRAM_BUCKETS (UTILS_HISTOGRAM_SUB_BUCKETS * (UTILS_HISTOGRAM_MAGNITUDES + 1))
+#define UTILS_HISTOGRAM_MAX_VALUE ((UINT64_C(1) << (UTILS_HISTOGRAM_MAGNITUDES + UTILS_HISTOGRAM_SUB_BUCKET_BITS)) - 1)
+
+/*
+** Stats
+** Log bucketed histogram with fixed memory and constant record cost.
+** Each bucket is within 1/UTILS_HISTOGRAM_SUB_BUCKETS (~6%) of the value recorded into it.
+*/
 typedef struct
 {
     /* First call has been made */
@@ -14,27 +25,35 @@ typedef struct
     /* Last timestamp */
     uint64_t last_time;
 
-    /* Total time and sample count */
-    uint64_t total;
-    uint32_t count;
-
-    /* Min / max time */
-    uint64_t min;
+    /* Sample count / max time */
+    uint64_t count;
     uint64_t max;
 
-} UTILS_TimeStats_t;
+    /* Sample counts per bucket */
+    uint32_t buckets[UTILS_HISTOGRAM_BUCKETS];
+
+} UTILS_Histogram_t;
 
-/* Init time stats */
-void UTILS_ResetTimeStats(UTILS_TimeStats_t *ctx);
+/* Init histogram */
+void UTILS_ResetHistogram(UTILS_Histogram_t *ctx);
 
 /* Start timer */
-void UTILS_StartTimeStats(UTILS_TimeStats_t *ctx);
+void UTILS_StartHistogram(UTILS_Histogram_t *ctx);
+
+/* Record time since last start / update and update last time */
+void UTILS_UpdateHistogram(UTILS_Histogram_t *ctx);
+
+/* Record value */
+void UTILS_RecordHistogram(UTILS_Histogram_t *ctx, uint64_t value);
+
+/* Calculate value at percentile (0 - 100), returning the upper bound of the bucket containing it */
+uint64_t UTILS_CalcPercentileHistogram(const UTILS_Histogram_t *ctx, double percentile);
 
-/* Update stats / last time */
-void UTILS_UpdateTimeStats(UTILS_TimeStats_t *ctx);
+/* Print p50 / p99 / p99.9 / max summary */
+void UTILS_PrintHistogram(const char *name, const UTILS_Histogram_t *ctx);
 
-/* Calculate average time */
-uint64_t UTILS_CalcAverageTimeStats(UTILS_TimeStats_t *ctx);
+/* Retrieve monotonic time in microseconds */
+uint64_t UTILS_GetMonotonicMicros(void);
 
 /* Set thread priority to realtime */
 int UTILS_SetThreadRealtimePriority(void);